@@ -4,6 +4,16 @@
 #include <stdio.h>
 #include <time.h>
 
+// Build with -DLOCK_PROF -I../../server and link ../../server/lock_prof.c and
+// ../../server/histogram.c to profile the mutex; run with LOCK_PROF=1 set
+// for a report at exit
+#ifdef LOCK_PROF
+#include "lock_prof.h"
+#else
+#define prof_mutex_lock(mutex) pthread_mutex_lock(mutex)
+#define prof_mutex_unlock(mutex) pthread_mutex_unlock(mutex)
+#endif
+
 // Optional: use these functions to add debug or error prints to your application
 //#define DEBUG_LOG(msg,...)
 #define DEBUG_LOG(msg,...) printf("threading: " msg "\n" , ##__VA_ARGS__)
@@ -38,7 +48,7 @@ void* threadfunc(void* thread_param)
 
     DEBUG_LOG("First sleep done");
 
-    ret = pthread_mutex_lock(thread_func_args->mutex);
+    ret = prof_mutex_lock(thread_func_args->mutex);
     if (ret != 0)
     {
         ERROR_LOG("Failed to lock mutex");
@@ -58,7 +68,7 @@ void* threadfunc(void* thread_param)
 
     DEBUG_LOG("Second sleep done");
 
-    ret = pthread_mutex_unlock(thread_func_args->mutex);
+    ret = prof_mutex_unlock(thread_func_args->mutex);
     if (ret != 0)
     {
         ERROR_LOG("Failed to unlock mutex");
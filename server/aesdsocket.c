@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,20 +16,93 @@
 #include <pthread.h>
 #include <stdbool.h>
 #include <time.h> 
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <semaphore.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <sys/random.h>
+#include <poll.h>
 #include "queue.h"
+#include "uring.h"
+#include "frame.h"
+#include "record_index.h"
+#include "chunk_cache.h"
+#include "timer_wheel.h"
+#include "metrics.h"
+#include "lock_prof.h"
+#include "async_log.h"
+#include "slab.h"
 
 
 // definations
 #define buffer_size 1024
+#define max_events 64
+#define uring_buf_count 8
+#define uring_buf_size 16384
+#define uring_timeout_tag (1ull << 32)     // user_data of a send's linked timeout
+#define replay_chunk (64 * 1024 * 1024)
+#define frame_max (16 * 1024 * 1024)    // longer packets are split, see frame_received()
+#define worker_stack_size (256 * 1024)
+#define view_min_len (1024 * 1024)
+#define cmd_prefix "AESDCHAR_IOC"         // starts with frame_mark
+#define seek_cmd "AESDCHAR_IOCSEEKTO:"
+#define range_cmd "AESDCHAR_IOCTIMERANGE:"
+#define delta_cmd "AESDCHAR_IOCDELTA:"
+#define subscribe_cmd "AESDCHAR_IOCSUBSCRIBE:"
+#define sub_queue_len 1024
+#define out_queue_len 16
+#define timer_tick_ms 100
+#define pool_idle_default_s 60
+#define stats_max 4096
+#define lock_report_max (64 * 1024)
+#define delta_token_max 1024
+#define record_index_max (4 * 1024 * 1024)  // newest records kept for AESDCHAR_IOCSEEKTO
+#define cache_chunk_size (256 * 1024)
+#define timestamp_prefix "timestamp: "
+#define timestamp_format_minute "%a, %d %b %Y %H:%M:"
+#define timestamp_format_zone " %z"
+#define timestamp_format timestamp_format_minute "%S" timestamp_format_zone
 
 // declrations
 void cleanup(int exit_code);
+void request_exit(int exit_code);
+void thread_fatal(void) __attribute__((noreturn));
 void sig_handler(int signo);
-void *timestamp(void *arg);
-void *connection(void *arg);
+void *ticker(void *arg);
+void *stats_server(void *arg);
+static void log_stats(bool print);
+void *worker(void *arg);
+void *acceptor(void *arg);
+void *event_loop(void *arg);
+void *appender(void *arg);
+void *syncer(void *arg);
+int append_data(const char *data, size_t len);
+int grow_view(off_t end);
+struct segment_t;
+struct session_t;
+int segment_open(unsigned seq, off_t base);
+int index_file(void);
+int read_data(char *buf, size_t len, off_t off);
+void session_init(struct session_t *session);
+struct idle_t;
+void idle_start(struct idle_t *idle, int sockfd);
+void segment_path(unsigned seq, char *path, size_t size);
+struct segment_t *segment_get(off_t offset);
+struct segment_t *segment_current(void);
+void segment_put(struct segment_t *seg);
+static int replay_file(int client_sockfd, off_t *offset, off_t end);
+static void append_fail(void);
+void pin_thread(int index);
 
 // data type
-int sockfd, client_sockfd, datafd, signal_exit = 0;
+int datafd, signal_exit = 0;
 
 typedef struct client_info
 {
@@ -36,20 +110,436 @@ typedef struct client_info
     char client_ip[INET_ADDRSTRLEN]; 
 } client_info_t;
 
-struct thread_info_t {
-    bool notification;
+// Idle timeout of a connection (-i). Progress only stores the tick in
+// last_active, the timer re-arms itself from it when it fires, so an
+// active connection never takes the wheel lock.
+struct idle_t {
+    struct wheel_timer_t timer;
+    int sockfd;
+    uint64_t last_active;
+    bool busy;              // in a blocking send, bounded by the send timeout instead
+};
+
+// Connection context for the worker pool. All of them are allocated up
+// front and recycled, so the pool never allocates per connection.
+struct conn_ctx_t {
+    client_info_t client_data;
+    struct idle_t idle;
+    SLIST_ENTRY(conn_ctx_t) entries;
+} __attribute__((aligned(slab_line)));   // workers next to each other share no line
+
+// Fixed set of workers serving connections from a bounded queue. There are
+// worker_count + queue_cap contexts; an acceptor takes a free one before
+// each accept, so a full pool pushes back into the kernel listen backlog and
+// memory stays bounded however many clients connect.
+struct worker_pool_t {
+    pthread_t *workers;
+    struct conn_ctx_t **serving;    // per worker, for shutdown() in cleanup
+    int worker_count;
+    struct conn_ctx_t *ctxs;
+    SLIST_HEAD(ctx_list_t, conn_ctx_t) free_ctxs;
+    struct conn_ctx_t **queue;      // ring of accepted connections
+    int queue_cap;
+    int queue_head;
+    int queue_len;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;          // workers wait for a connection
+    pthread_cond_t ctx_freed;       // acceptors wait for a free context
+};
+
+struct worker_pool_t pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .queued = PTHREAD_COND_INITIALIZER,
+    .ctx_freed = PTHREAD_COND_INITIALIZER,
+};
+int worker_count = 0;
+int queue_cap = 256;
+
+// Listening socket with its own accept thread (-l)
+struct listener_t {
+    int index;
+    int sockfd;
     pthread_t thread_id;
+};
+
+struct listener_t *listeners = NULL;
+int listener_count = 1;
+int listen_backlog = SOMAXCONN;
+bool pin_cpus = false;
+
+// A replay due on a connection: the data in [off, end), and for a delta
+// replay the cursor to store once it is sent (-1 otherwise)
+struct replay_t {
+    off_t off;
+    off_t end;
+    off_t cursor_end;
+    uint64_t queued_ns;     // when the packets it answers were in the file
+    uint64_t started_ns;    // when its first byte went out, 0 until then
+};
+
+// Delta replay, negotiated with an AESDCHAR_IOCDELTA:[token] handshake:
+// the connection only receives what was appended since its previous
+// replay. The cursor is kept under the token when the connection closes,
+// so a client that reconnects with it resumes where it left off.
+struct session_t {
+    struct subscriber_t *sub;   // set once the connection subscribed
+    bool delta;
+    uint64_t token;
+    off_t cursor;           // end of the last complete delta replay
+    off_t queued_end;       // end of the newest delta replay not sent yet, -1 if none
+    char reply[64];         // handshake reply, sent ahead of the replay
+    size_t reply_len;
+    size_t reply_sent;
+};
+
+// Appended batch shared by all subscribers, copied once by the appender
+struct pub_buf_t {
+    int refs;
+    size_t len;
+    char data[];
+};
+
+// Subscribe mode (AESDCHAR_IOCSUBSCRIBE:): the connection is sent every
+// batch as it is appended instead of replays. The appender queues a
+// reference to the batch and wakes the owner through wakefd; the owner
+// sends the queue with one sendmsg per IOV_MAX buffers. A subscriber
+// that falls sub_max_bytes or sub_queue_len batches behind is dropped.
+struct subscriber_t {
+    int wakefd;
+    pthread_mutex_t lock;
+    struct pub_buf_t *queue[sub_queue_len];
+    size_t head;
+    size_t count;
+    size_t sent;            // bytes of queue[head] already sent
+    size_t queued_bytes;
+    bool overflow;
+    LIST_ENTRY(subscriber_t) entries;
+};
+
+LIST_HEAD(subscriber_list_t, subscriber_t) subscribers = LIST_HEAD_INITIALIZER(subscribers);
+pthread_mutex_t subscribers_mutex = PTHREAD_MUTEX_INITIALIZER;
+int subscriber_count = 0;
+size_t sub_max_bytes = 4 * 1024 * 1024;
+
+// Cursors of closed delta sessions, the least recently used is evicted
+struct delta_cursor_t {
+    uint64_t token;
+    off_t cursor;
+    unsigned long used;
+};
+
+struct delta_cursor_t delta_cursors[delta_token_max];
+unsigned long delta_clock = 0;
+pthread_mutex_t delta_cursors_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// What an epoll connection does when its output queue goes over out_high
+// bytes (-W high[,low]), e.g. a client that sends but never reads (-P)
+enum out_policy_t { OUT_PAUSE, OUT_DISCONNECT, OUT_DROP };
+enum out_policy_t out_policy = OUT_PAUSE;
+off_t out_high = 0;
+off_t out_low = 0;
+
+// A blocking send that makes no progress for this long fails (-O),
+// so a stalled receiver can't hold a pool worker forever
+int send_timeout_ms = 30000;
+
+// Timers shared by all threads, ticked every timer_tick_ms by the ticker
+// thread: the timestamp and the connection idle timeouts (-i seconds, 0
+// for none). A wheel keeps both O(1) however many connections there are.
+// An idle client holds a pool worker, so without -i the pool expires them
+// after pool_idle_default_s, or the -n idle ones would starve the queue.
+struct timer_wheel_t timers;
+pthread_t ticker_thread;
+pthread_mutex_t timers_mutex = PTHREAD_MUTEX_INITIALIZER;
+uint64_t timer_ticks = 0;           // current tick, read without the lock
+int idle_timeout_s = -1;            // until main() settles the default
+struct wheel_timer_t timestamp_timer;
+bool timestamp_due = false;         // set under timers_mutex, written by the ticker
+int timestamp_interval_s = 10;      // -T, aligned to multiples of it since the epoch
+
+// Local socket serving the metrics as JSON to whoever connects (-M path);
+// SIGUSR1 logs the same line. With lock profiling (-L) a second line has
+// the per call site lock stats, also logged at exit.
+const char *stats_path = NULL;
+int stats_sockfd = -1;
+pthread_t stats_thread;
+volatile sig_atomic_t stats_requested = 0;
+
+// Logging through the async_log drain thread: to syslog or appended to
+// -o file, less severe than -v level dropped, at most -r messages per
+// second per thread (0 for no limit)
+const char *log_path = NULL;
+int log_level = LOG_DEBUG;
+unsigned log_rate = 0;
+volatile sig_atomic_t exit_requested = 0;
+int exit_status = EXIT_SUCCESS;     // what the main loop exits with, see request_exit()
+bool cleanup_started = false;
+
+// Last timestamp record formatted. Within a minute only the seconds
+// digits change, so only those are rewritten. Ticker thread only.
+struct timestamp_cache_t {
+    time_t minute;          // time / 60 of the cached text, -1 if none
+    char text[100];
+    size_t len;
+    size_t sec_pos;         // offset of the seconds digits in text
+};
+struct timestamp_cache_t timestamp_cache = { .minute = -1 };
+
+// Chunks shared by concurrent io_uring replays (-C), off when cache_bytes is 0
+struct chunk_cache_t replay_cache;
+size_t cache_bytes = 0;
+
+// Client socket owned by an event loop (-e mode). Only the owning loop
+// thread touches it, so no locking is needed per connection.
+struct conn_t {
     client_info_t client_data;
-    SLIST_ENTRY(thread_info_t) entries;
+    struct idle_t idle;
+    struct frame_buf_t frame;
+    struct session_t session;
+    bool sub_watched;       // the subscriber wakefd is in the epoll set
+    // Output queue: replays due, sent in order from out[out_head]. They
+    // point into the data, so a backlog costs no memory, only progress.
+    struct replay_t out[out_queue_len];
+    unsigned out_head;
+    unsigned out_count;
+    bool paused;            // over the high watermark, input is not read
+    LIST_ENTRY(conn_t) entries;
+};
+
+struct event_loop_t {
+    pthread_t thread_id;
+    int epollfd;
+    pthread_mutex_t conn_list_mutex;    // acceptors insert, the loop removes
+    LIST_HEAD(conn_list_t, conn_t) conn_list;
+};
+
+bool epoll_mode = false;
+bool uring_mode = false;
+int loop_count = 0;
+int loop_wakefd = -1;
+struct event_loop_t *loops = NULL;
+
+static void close_conn(struct event_loop_t *loop, struct conn_t *conn);
+
+// Append request handed to the appender thread. It lives on the
+// producer's stack, the producer blocks on done until it is written.
+struct append_req_t {
+    const char *data;
+    size_t len;
+    int result;
+    sem_t done;
+    struct append_req_t *next;
+};
+
+// Lock-free MPSC stack of pending appends, newest first. Producers push
+// with a CAS, the appender takes the whole stack with one exchange.
+struct append_req_t *append_head = NULL;
+sem_t append_wake;
+pthread_t appender_thread;
+bool append_stop = false;           // set by cleanup() once the producers are joined
+bool append_failed = false;         // appender only, every request fails from then on
+
+// End of the data the appender has completely written, always on a packet
+// boundary. Only the appender stores it; replays load it once and read up
+// to it with positional I/O, so they never take a lock or see a torn batch.
+off_t data_end = 0;
+
+// Read-only shared mapping of the data file (-m). The appender maps a
+// bigger view, doubling, before it publishes an end past the current one,
+// so a reader that loads data_end and then data_view can always serve
+// [0, end) from it. Older views stay mapped for readers still using them.
+struct data_view_t {
+    const char *base;
+    size_t len;
+    struct data_view_t *prev;
+};
+
+struct data_view_t *data_view = NULL;
+bool mmap_mode = false;
+
+// Data log segment. Without -S there is a single segment, the classic
+// /var/tmp/aesdsocketdata. With -S the appender starts a new file every
+// segment_size bytes and drops or archives the oldest ones beyond the
+// retention cap. Offsets elsewhere (data_end, replays) are logical
+// offsets into the concatenation of all segments ever written.
+struct segment_t {
+    int fd;
+    unsigned seq;
+    off_t base;         // logical offset of the first byte
+    off_t len;          // stored by the appender before data_end moves
+    size_t records;
+    int refs;           // the list's reference plus readers, under segment_mutex
+    // len and records are only written by the appender
+    TAILQ_ENTRY(segment_t) entries;
 };
 
-SLIST_HEAD(thread_list_t, thread_info_t) thread_list;
+TAILQ_HEAD(segment_list_t, segment_t) segments = TAILQ_HEAD_INITIALIZER(segments);
+pthread_mutex_t segment_mutex = PTHREAD_MUTEX_INITIALIZER;
+const char *aesddata_file = "/var/tmp/aesdsocketdata";
+off_t segment_size = 0;
+off_t retain_bytes = 0;
+size_t retain_records = 0;
+size_t retained_records = 0;
+const char *archive_dir = NULL;
+
+// Packet boundaries for AESDCHAR_IOCSEEKTO and timestamp records for
+// AESDCHAR_IOCTIMERANGE, filled in by the appender
+struct record_index_t record_index;
+struct time_index_t time_index;
+pthread_mutex_t record_index_mutex = PTHREAD_MUTEX_INITIALIZER;
+off_t record_start = 0;     // start of the record in progress, appender only
+
+// How appended data is made durable (-s)
+enum durability_t {
+    DURABILITY_NONE,        // left to the page cache, as before
+    DURABILITY_PERIODIC,    // fdatasync every sync_interval_ms if anything was written
+    DURABILITY_GROUP,       // one fdatasync per appender batch, before producers return
+};
 
-pthread_mutex_t aesddata_file_mutex = PTHREAD_MUTEX_INITIALIZER;
+enum durability_t durability = DURABILITY_NONE;
+int sync_interval_ms = 1000;
+bool data_dirty = false;
+pthread_t syncer_thread;
 
 int main(int argc, char *argv[]) {
 
-    if (argc > 1 && strcmp(argv[1], "-d") == 0) {
+    bool daemon_mode = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "A:aB:b:C:dei:Ll:M:mN:n:O:o:P:q:R:r:S:T:up:s:v:W:")) != -1) {
+        switch (opt) {
+        case 'A':
+            archive_dir = optarg;
+            break;
+        case 'a':
+            pin_cpus = true;
+            break;
+        case 'B':
+            sub_max_bytes = strtoull(optarg, NULL, 10);
+            break;
+        case 'C':
+            cache_bytes = strtoull(optarg, NULL, 10);
+            break;
+        case 'b':
+            listen_backlog = atoi(optarg);
+            if (listen_backlog <= 0) listen_backlog = SOMAXCONN;
+            break;
+        case 'd':
+            daemon_mode = true;
+            break;
+        case 'i':
+            idle_timeout_s = atoi(optarg);
+            if (idle_timeout_s < 0) idle_timeout_s = 0;
+            break;
+        case 'L':
+            lock_prof_enable();
+            break;
+        case 'l':
+            listener_count = atoi(optarg);
+            if (listener_count <= 0) listener_count = 1;
+            break;
+        case 'e':
+            epoll_mode = true;
+            break;
+        case 'M':
+            stats_path = optarg;
+            break;
+        case 'm':
+            mmap_mode = true;
+            break;
+        case 'O':
+            send_timeout_ms = atoi(optarg);
+            break;
+        case 'o':
+            log_path = optarg;
+            break;
+        case 'r':
+            log_rate = strtoul(optarg, NULL, 10);
+            break;
+        case 'v':
+            log_level = async_log_level(optarg);
+            if (log_level == -1) {
+                fprintf(stderr, "Unknown log level %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'P':
+            if (strcmp(optarg, "pause") == 0) {
+                out_policy = OUT_PAUSE;
+            } else if (strcmp(optarg, "disconnect") == 0) {
+                out_policy = OUT_DISCONNECT;
+            } else if (strcmp(optarg, "drop") == 0) {
+                out_policy = OUT_DROP;
+            } else {
+                fprintf(stderr, "Unknown output policy %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'W': {
+            char *low;
+            out_high = strtoll(optarg, &low, 10);
+            out_low = *low == ',' ? strtoll(low + 1, NULL, 10) : out_high / 2;
+            if (out_low > out_high) out_low = out_high;
+            break;
+        }
+        case 'N':
+            retain_records = strtoul(optarg, NULL, 10);
+            break;
+        case 'R':
+            retain_bytes = strtoll(optarg, NULL, 10);
+            break;
+        case 'S':
+            segment_size = strtoll(optarg, NULL, 10);
+            break;
+        case 'T':
+            timestamp_interval_s = atoi(optarg);
+            if (timestamp_interval_s <= 0) timestamp_interval_s = 10;
+            break;
+        case 'n':
+            loop_count = atoi(optarg);
+            break;
+        case 'q':
+            queue_cap = atoi(optarg);
+            if (queue_cap <= 0) queue_cap = 256;
+            break;
+        case 'u':
+            uring_mode = true;
+            break;
+        case 's':
+            if (strcmp(optarg, "none") == 0) {
+                durability = DURABILITY_NONE;
+            } else if (strcmp(optarg, "periodic") == 0) {
+                durability = DURABILITY_PERIODIC;
+            } else if (strcmp(optarg, "group") == 0) {
+                durability = DURABILITY_GROUP;
+            } else {
+                fprintf(stderr, "Unknown durability mode %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'p':
+            sync_interval_ms = atoi(optarg);
+            if (sync_interval_ms <= 0) sync_interval_ms = 1000;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-d] [-a] [-b backlog] [-l listeners] [-e] [-m] [-n threads] [-q queue] [-u] [-s none|periodic|group] [-p sync_ms]"
+                    " [-S segment_bytes] [-R retain_bytes] [-N retain_records] [-A archive_dir] [-C cache_bytes (with -u)] [-B subscriber_bytes]"
+                    " [-W high[,low]] [-P pause|disconnect|drop] [-O send_timeout_ms] [-i idle_s (60 without -e, 0 for none)] [-T timestamp_s] [-M stats_socket] [-L]"
+                    " [-o log_file] [-v level] [-r log_rate]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (idle_timeout_s < 0) {
+        idle_timeout_s = epoll_mode ? 0 : pool_idle_default_s;
+    }
+
+    // The chunk cache only serves io_uring replays
+    if (cache_bytes > 0 && !uring_mode) {
+        fprintf(stderr, "-C needs the io_uring engine (-u)\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (daemon_mode) {
 		pid_t pid, sid;
 
 		// Fork the process
@@ -57,7 +547,7 @@ int main(int argc, char *argv[]) {
 
 		// Error with fork
 		if (pid < 0) {
-			syslog(LOG_ERR, "ERROR: Failed to fork");
+			async_log(LOG_ERR, "ERROR: Failed to fork");
 			cleanup(EXIT_FAILURE);
 		}
 
@@ -69,7 +559,7 @@ int main(int argc, char *argv[]) {
 		// Create a new SID for child process
 		sid = setsid();
 		if (sid < 0) {
-			syslog(LOG_ERR, "ERROR: Failed to setsid");
+			async_log(LOG_ERR, "ERROR: Failed to setsid");
 			cleanup(EXIT_FAILURE);
     	}
 
@@ -79,135 +569,535 @@ int main(int argc, char *argv[]) {
 		close(STDERR_FILENO);
     }
 
+    // io_uring engine for connection threads, if the kernel allows it
+    if (uring_mode && epoll_mode) {
+        async_log(LOG_WARNING, "io_uring engine is not used in epoll mode");
+        uring_mode = false;
+    }
+    if (uring_mode && !uring_supported()) {
+        async_log(LOG_WARNING, "io_uring unavailable, using blocking syscalls");
+        uring_mode = false;
+    }
+
+    // Log from a background thread from here on, after the fork
+    if (async_log_start(log_path, log_level, log_rate) == -1) {
+        async_log(LOG_ERR, "ERROR: Failed to start logging%s%s", log_path != NULL ? " to " : "",
+                  log_path != NULL ? log_path : "");
+        exit(EXIT_FAILURE);
+    }
+
     // Set up signal handlers
     signal(SIGINT, sig_handler);
     signal(SIGTERM, sig_handler);
+    signal(SIGUSR1, sig_handler);
+    // sendfile() can't take MSG_NOSIGNAL, report closed peers as EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
+    // Held until the main loop waits for them in sigsuspend(), so the
+    // handler only ever runs there and cleanup() can join the others.
+    // Every thread started from here on inherits the mask.
+    sigset_t handled, wait_mask;
+    sigemptyset(&handled);
+    sigaddset(&handled, SIGINT);
+    sigaddset(&handled, SIGTERM);
+    sigaddset(&handled, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &handled, &wait_mask);
+
+    // One listening socket per -l, they share port 9000 with SO_REUSEPORT
+    // and the kernel spreads incoming connections across them
+    listeners = calloc(listener_count, sizeof(struct listener_t));
+    if (listeners == NULL) {
+        async_log(LOG_ERR, "ERROR: Failed to malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < listener_count; i++) {
+        listeners[i].index = i;
+        listeners[i].sockfd = -1;
+    }
+    for (int i = 0; i < listener_count; i++) {
+        int one = 1;
+
+        // Create a socket
+        int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+        if (sockfd == -1) {
+            async_log(LOG_ERR, "Failed to create socket");
+            cleanup(EXIT_FAILURE);
+        }
+        listeners[i].sockfd = sockfd;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1 ||
+            (listener_count > 1 && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1)) {
+            async_log(LOG_ERR, "ERROR: Failed to set socket options");
+            cleanup(EXIT_FAILURE);
+        }
+
+        // Bind to port 9000
+        struct sockaddr_in server_addr;
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        server_addr.sin_port = htons(9000);
+
+        if (bind(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
+            async_log(LOG_ERR, "ERROR: Failed to bind");
+            cleanup(EXIT_FAILURE);
+        }
 
-    // Initialize thread list
-    SLIST_INIT(&thread_list);
+        // Listen for connections
+        if (listen(sockfd, listen_backlog) == -1) {
+            async_log(LOG_ERR, "ERROR: Failed to listen");
+            cleanup(EXIT_FAILURE);
+        }
+    }
+
+    // Open file for aesdsocketdata, the first segment with -S
+    if (segment_open(0, 0) == -1) {
+        exit(EXIT_FAILURE);
+    }
+    record_index_init(&record_index, 0);
+    time_index_init(&time_index);
+    if (index_file() == -1) {
+        exit(EXIT_FAILURE);
+    }
+    if (segment_size > 0 && mmap_mode) {
+        async_log(LOG_WARNING, "-m maps a single data file, not used with -S");
+        mmap_mode = false;
+    }
+
+    if (mmap_mode && grow_view(data_end) == -1) {
+        async_log(LOG_WARNING, "Failed to map %s, replaying with sendfile", aesddata_file);
+    }
+
+    if (durability != DURABILITY_NONE) {
+        // Make the new directory entry durable once, fdatasync covers the rest
+        int dirfd = open("/var/tmp", O_RDONLY | O_DIRECTORY);
+        if (dirfd == -1 || fsync(dirfd) == -1) {
+            async_log(LOG_WARNING, "Failed to sync /var/tmp");
+        }
+        if (dirfd >= 0) close(dirfd);
+    }
+    if (durability == DURABILITY_PERIODIC) {
+        if (pthread_create(&syncer_thread, NULL, syncer, NULL) != 0) {
+            async_log(LOG_ERR, "ERROR: Failed to create sync thread!");
+            cleanup(EXIT_FAILURE);
+        }
+    }
 
-    // Create a socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd == -1) {
-        syslog(LOG_ERR, "Failed to create socket");
+    if (uring_mode && cache_bytes > 0 &&
+        chunk_cache_init(&replay_cache, cache_chunk_size, cache_bytes, read_data) == -1) {
+        async_log(LOG_ERR, "ERROR: Failed to malloc");
         cleanup(EXIT_FAILURE);
     }
 
-    // Bind to port 9000
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    server_addr.sin_port = htons(9000);
+    // Single writer for the data file, fed by append_data()
+    sem_init(&append_wake, 0, 0);
+    if (pthread_create(&appender_thread, NULL, appender, NULL) != 0) {
+        async_log(LOG_ERR, "ERROR: Failed to create appender thread!");
+        cleanup(EXIT_FAILURE);
+    }
 
-    if (bind(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
-        syslog(LOG_ERR, "ERROR: Failed to bind");
+    // Dedicated thread for the timers, it appends the timestamps
+    timer_wheel_init(&timers, 0);
+    if (pthread_create(&ticker_thread, NULL, ticker, NULL) != 0) {
+        async_log(LOG_ERR, "ERROR: Failed to create timer thread!");
         cleanup(EXIT_FAILURE);
     }
 
-    close(-1);
-    
-    // Listen for connections
-    if (listen(sockfd, 5) == -1) {
-        syslog(LOG_ERR, "ERROR: Failed to listen");
-        close(sockfd);
-        return -1;
+    // Event loop threads which own all client sockets in -e mode
+    if (!epoll_mode) {
+        // Worker pool, -n threads
+        worker_count = loop_count > 0 ? loop_count : 64;
+        pool.worker_count = worker_count;
+        pool.queue_cap = queue_cap;
+        pool.workers = calloc(worker_count, sizeof(pthread_t));
+        pool.serving = calloc(worker_count, sizeof(struct conn_ctx_t *));
+        pool.ctxs = aligned_alloc(slab_line, (worker_count + queue_cap) * sizeof(struct conn_ctx_t));
+        pool.queue = calloc(queue_cap, sizeof(struct conn_ctx_t *));
+        if (pool.workers == NULL || pool.serving == NULL || pool.ctxs == NULL || pool.queue == NULL) {
+            async_log(LOG_ERR, "ERROR: Failed to malloc");
+            cleanup(EXIT_FAILURE);
+        }
+        memset(pool.ctxs, 0, (worker_count + queue_cap) * sizeof(struct conn_ctx_t));
+        SLIST_INIT(&pool.free_ctxs);
+        for (int i = 0; i < worker_count + queue_cap; i++) {
+            SLIST_INSERT_HEAD(&pool.free_ctxs, &pool.ctxs[i], entries);
+        }
+
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setstacksize(&attr, worker_stack_size);
+        for (intptr_t i = 0; i < worker_count; i++) {
+            if (pthread_create(&pool.workers[i], &attr, worker, (void *)i) != 0) {
+                async_log(LOG_ERR, "ERROR: Failed to create worker thread!");
+                cleanup(EXIT_FAILURE);
+            }
+        }
+        pthread_attr_destroy(&attr);
+    }
+    else {
+        if (loop_count <= 0) {
+            loop_count = sysconf(_SC_NPROCESSORS_ONLN);
+            if (loop_count <= 0) loop_count = 1;
+        }
+        loop_wakefd = eventfd(0, EFD_NONBLOCK);
+        loops = calloc(loop_count, sizeof(struct event_loop_t));
+        if (loop_wakefd == -1 || loops == NULL) {
+            async_log(LOG_ERR, "ERROR: Failed to set up event loops");
+            cleanup(EXIT_FAILURE);
+        }
+        for (int i = 0; i < loop_count; i++) {
+            struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+            LIST_INIT(&loops[i].conn_list);
+            pthread_mutex_init(&loops[i].conn_list_mutex, NULL);
+            loops[i].epollfd = epoll_create1(0);
+            if (loops[i].epollfd == -1 ||
+                epoll_ctl(loops[i].epollfd, EPOLL_CTL_ADD, loop_wakefd, &ev) == -1) {
+                async_log(LOG_ERR, "ERROR: Failed to create epoll instance");
+                cleanup(EXIT_FAILURE);
+            }
+            if (pthread_create(&loops[i].thread_id, NULL, event_loop, &loops[i]) != 0) {
+                async_log(LOG_ERR, "ERROR: Failed to create event loop thread!");
+                cleanup(EXIT_FAILURE);
+            }
+        }
     }
 
-    // Open file for aesdsocketdata
-    char *aesddata_file = "/var/tmp/aesdsocketdata";
-    datafd = open(aesddata_file, O_CREAT | O_RDWR | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-    if (datafd == -1){
-        syslog(LOG_ERR, "ERROR: Failed to create file - %s", aesddata_file);
-        exit(EXIT_FAILURE);
+    // Accept connections on every listener
+    for (int i = 0; i < listener_count; i++) {
+        if (pthread_create(&listeners[i].thread_id, NULL, acceptor, &listeners[i]) != 0) {
+            async_log(LOG_ERR, "ERROR: Failed to create accept thread!");
+            cleanup(EXIT_FAILURE);
+        }
     }
 
-    // Dedicated thread to append timestamps
-    pthread_t timestamp_thread;
-    if (pthread_create(&timestamp_thread, NULL, timestamp, NULL) != 0) {
-        syslog(LOG_ERR, "ERROR: Failed to create timestamp thread!");
-        cleanup(EXIT_FAILURE);
+    // Serve the metrics on the stats socket
+    if (stats_path != NULL) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", stats_path);
+        unlink(stats_path);
+        stats_sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (stats_sockfd == -1 || bind(stats_sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+            listen(stats_sockfd, 8) == -1) {
+            async_log(LOG_ERR, "ERROR: Failed to open stats socket %s", stats_path);
+            cleanup(EXIT_FAILURE);
+        }
+        if (pthread_create(&stats_thread, NULL, stats_server, NULL) != 0) {
+            async_log(LOG_ERR, "ERROR: Failed to create stats thread!");
+            cleanup(EXIT_FAILURE);
+        }
+    }
+
+    // The main thread only handles signals from here on, SIGUSR1 dumps the
+    // metrics and SIGINT/SIGTERM clean up, outside the handler
+    while (1) {
+        if (exit_requested) {
+            cleanup(__atomic_load_n(&exit_status, __ATOMIC_RELAXED));
+        }
+        if (stats_requested) {
+            stats_requested = 0;
+            log_stats(!daemon_mode);
+        }
+        sigsuspend(&wait_mask);
+    }
+    return 0;
+}
+
+// Log one line from a *_format() call without its newline. Nothing if the
+// call wrote nothing, the buffer being too small for it.
+static void log_stats_line(const char *name, const char *line, size_t len, bool print)
+{
+    if (len == 0) return;
+    async_log(LOG_INFO, "%s %.*s", name, (int)len - 1, line);
+    if (print) fwrite(line, 1, len, stdout);
+}
+
+// Log the metrics line, the slab pool stats line, and the lock stats
+// line when profiling, and print them to stdout too if asked
+static void log_stats(bool print)
+{
+    char stats[stats_max];
+    size_t len = metrics_format(stats, sizeof(stats));
+    log_stats_line("stats", stats, len, print);
+
+    len = slab_format(stats, sizeof(stats));
+    log_stats_line("slab", stats, len, print);
+
+    char *locks;
+    if (lock_prof_enabled && (locks = malloc(lock_report_max)) != NULL) {
+        len = lock_prof_format(locks, lock_report_max);
+        log_stats_line("locks", locks, len, print);
+        free(locks);
+    }
+    if (print) fflush(stdout);
+}
+
+// Stats thread: each connection to the stats socket gets the JSON lines
+void *stats_server(void *arg)
+{
+    (void)arg;
+
+    while (!signal_exit) {
+        int fd = accept4(stats_sockfd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) continue;
+        char stats[stats_max];
+        size_t len = metrics_format(stats, sizeof(stats));
+        if (send(fd, stats, len, MSG_NOSIGNAL) == -1) {
+            async_log(LOG_WARNING, "Failed to send stats");
+        }
+        len = slab_format(stats, sizeof(stats));
+        if (send(fd, stats, len, MSG_NOSIGNAL) == -1) {
+            async_log(LOG_WARNING, "Failed to send stats");
+        }
+        char *locks;
+        if (lock_prof_enabled && (locks = malloc(lock_report_max)) != NULL) {
+            len = lock_prof_format(locks, lock_report_max);
+            if (send(fd, locks, len, MSG_NOSIGNAL) == -1) {
+                async_log(LOG_WARNING, "Failed to send stats");
+            }
+            free(locks);
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+// Accept thread, one per listening socket
+void *acceptor(void *arg)
+{
+    struct listener_t *listener = (struct listener_t *)arg;
+
+    if (pin_cpus) {
+        pin_thread(listener->index);
     }
 
     // Accept connections in a loop
     struct sockaddr_in client_addr;
     socklen_t client_addr_len = sizeof(client_addr);
-    
-    while (1) {
-        client_sockfd = accept(sockfd, (struct sockaddr*)&client_addr, &client_addr_len);
+    int next_loop = listener->index % (loop_count > 0 ? loop_count : 1);
+
+    while (!signal_exit) {
+        struct conn_ctx_t *ctx = NULL;
+        if (!epoll_mode) {
+            // Wait for a free context before accepting, this is the memory bound
+            pthread_mutex_lock(&pool.lock);
+            while (SLIST_EMPTY(&pool.free_ctxs) && !signal_exit) {
+                pthread_cond_wait(&pool.ctx_freed, &pool.lock);
+            }
+            if (signal_exit) {
+                pthread_mutex_unlock(&pool.lock);
+                break;
+            }
+            ctx = SLIST_FIRST(&pool.free_ctxs);
+            SLIST_REMOVE_HEAD(&pool.free_ctxs, entries);
+            pthread_mutex_unlock(&pool.lock);
+        }
+
+        client_addr_len = sizeof(client_addr);
+        int client_sockfd = accept4(listener->sockfd, (struct sockaddr*)&client_addr, &client_addr_len,
+                                    epoll_mode ? SOCK_NONBLOCK : 0);
         if (client_sockfd == -1) {
-            syslog(LOG_WARNING, "Failed to accept connection");
+            if (!signal_exit) async_log(LOG_WARNING, "Failed to accept connection");
+            if (ctx != NULL) {
+                prof_mutex_lock(&pool.lock);
+                SLIST_INSERT_HEAD(&pool.free_ctxs, ctx, entries);
+                prof_mutex_unlock(&pool.lock);
+            }
             // Continue accepting connections
             continue;
         }
 
-        struct thread_info_t *new_thread = malloc(sizeof(struct thread_info_t));
-        if (new_thread == NULL) {
-            syslog(LOG_ERR, "ERROR: Failed to malloc");
-            cleanup(EXIT_FAILURE);
-        }
+        metrics_add(METRIC_ACCEPTS, 1);
 
-        // Log accepted connection
-        inet_ntop(AF_INET, &(client_addr.sin_addr), new_thread->client_data.client_ip, INET_ADDRSTRLEN);
-        syslog(LOG_INFO, "Accepted connection from %s", new_thread->client_data.client_ip);
+        if (epoll_mode) {
+            // Hand the socket to the next event loop, round robin
+            // From the slab pools, the event loop returns it there on close
+            struct conn_t *conn = slab_alloc(sizeof(struct conn_t));
+            if (conn != NULL) memset(conn, 0, sizeof(*conn));
+            if (conn == NULL || frame_init(&conn->frame, buffer_size) == -1) {
+                async_log(LOG_ERR, "ERROR: Failed to malloc");
+                thread_fatal();
+            }
+            session_init(&conn->session);
+            inet_ntop(AF_INET, &(client_addr.sin_addr), conn->client_data.client_ip, INET_ADDRSTRLEN);
+            async_log(LOG_INFO, "Accepted connection from %s", conn->client_data.client_ip);
+            conn->client_data.client_sockfd = client_sockfd;
 
-        new_thread->client_data.client_sockfd = client_sockfd;
-        new_thread->notification = 0;
+            idle_start(&conn->idle, client_sockfd);
 
-        // Handle connection
-        if (pthread_create(&new_thread->thread_id, NULL, connection, (void *)new_thread) != 0) {
-            syslog(LOG_ERR, "ERROR: Failed to create thread!");
-            cleanup(EXIT_FAILURE);
-        }
-        else {
-            SLIST_INSERT_HEAD(&thread_list, new_thread, entries);
+            struct event_loop_t *loop = &loops[next_loop];
+            next_loop = (next_loop + 1) % loop_count;
+            struct epoll_event ev = {
+                .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+                .data.ptr = conn,
+            };
+            prof_mutex_lock(&loop->conn_list_mutex);
+            LIST_INSERT_HEAD(&loop->conn_list, conn, entries);
+            prof_mutex_unlock(&loop->conn_list_mutex);
+            if (epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, client_sockfd, &ev) == -1) {
+                async_log(LOG_ERR, "ERROR: Failed to add connection to event loop");
+                close_conn(loop, conn);
+            }
+            continue;
         }
 
-        // Join complete threads
-        struct thread_info_t *thread, *thread_tmp;
-        SLIST_FOREACH_SAFE(thread, &thread_list, entries, thread_tmp) {
-            if (thread->notification == 1) {
-                syslog(LOG_INFO, "main - joining thread %ld\n", thread->thread_id);
-                if (pthread_join(thread->thread_id, NULL) != 0) {
-                    syslog(LOG_ERR, "main - error joining thread!");
-                    cleanup(EXIT_FAILURE);
-                }
-                SLIST_REMOVE(&thread_list, thread, thread_info_t, entries);
-                free(thread);
-            }
+        if (send_timeout_ms > 0) {
+            // A receiver that stops reading fails the send instead of holding the worker
+            struct timeval tv = { .tv_sec = send_timeout_ms / 1000, .tv_usec = (send_timeout_ms % 1000) * 1000 };
+            setsockopt(client_sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
         }
+
+        // Log accepted connection
+        inet_ntop(AF_INET, &(client_addr.sin_addr), ctx->client_data.client_ip, INET_ADDRSTRLEN);
+        async_log(LOG_INFO, "Accepted connection from %s", ctx->client_data.client_ip);
+        ctx->client_data.client_sockfd = client_sockfd;
+
+        // Queue it for the workers, there is always room for a context we hold
+        // Profiled, unlike the sites that wait on the pool conditions
+        prof_mutex_lock(&pool.lock);
+        pool.queue[(pool.queue_head + pool.queue_len) % pool.queue_cap] = ctx;
+        pool.queue_len++;
+        pthread_cond_signal(&pool.queued);
+        prof_mutex_unlock(&pool.lock);
+    }
+    return NULL;
+}
+
+// Join a thread started by main(), unless it was not started or is the caller
+static void join_thread(pthread_t thread_id, const char *name)
+{
+    if (thread_id == 0 || pthread_equal(thread_id, pthread_self())) {
+        return;
+    }
+    if (pthread_join(thread_id, NULL) != 0) {
+        async_log(LOG_ERR, "cleanup - error joining %s thread!", name);
+        exit(EXIT_FAILURE);
     }
-    return 0;
 }
 
 void cleanup(int exit_code) {
 
-    syslog(LOG_INFO, "performing cleanup");
+    // Only once: a second caller would join the threads the first one is
+    // joining. The other threads hand their fatal errors to the main loop.
+    if (__atomic_exchange_n(&cleanup_started, true, __ATOMIC_ACQ_REL)) {
+        pthread_exit(NULL);
+    }
+
+    async_log(LOG_INFO, "performing cleanup");
     signal_exit = 1;
 
-    // Clean up threads
-    struct thread_info_t *thread;
-    while (!SLIST_EMPTY(&thread_list)) {
-        thread = SLIST_FIRST(&thread_list);
-        SLIST_REMOVE_HEAD(&thread_list, entries);
-        syslog(LOG_INFO, "cleanup - joining thread %ld", thread->thread_id);
-        if (pthread_join(thread->thread_id, NULL) != 0) {
-            syslog(LOG_ERR, "cleanup - error joining thread!");
-            exit(EXIT_FAILURE);
+    // Stop accepting, shutdown() wakes a thread blocked in accept()
+    if (listeners != NULL) {
+        pthread_mutex_lock(&pool.lock);
+        pthread_cond_broadcast(&pool.ctx_freed);
+        pthread_mutex_unlock(&pool.lock);
+        for (int i = 0; i < listener_count; i++) {
+            if (listeners[i].sockfd >= 0) shutdown(listeners[i].sockfd, SHUT_RDWR);
+        }
+        for (int i = 0; i < listener_count; i++) {
+            if (listeners[i].thread_id == 0 || pthread_equal(listeners[i].thread_id, pthread_self())) {
+                continue;
+            }
+            if (pthread_join(listeners[i].thread_id, NULL) != 0) {
+                async_log(LOG_ERR, "cleanup - error joining accept thread!");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    // Wake and stop the event loops, they close their own connections
+    if (loops != NULL) {
+        uint64_t one = 1;
+        if (write(loop_wakefd, &one, sizeof(one)) == -1) {
+            async_log(LOG_ERR, "cleanup - failed to wake event loops");
+        }
+        for (int i = 0; i < loop_count; i++) {
+            if (loops[i].thread_id == 0 || pthread_equal(loops[i].thread_id, pthread_self())) {
+                continue;
+            }
+            if (pthread_join(loops[i].thread_id, NULL) != 0) {
+                async_log(LOG_ERR, "cleanup - error joining event loop!");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    // Clean up threads, shutting down the sockets being served unblocks their workers
+    if (pool.workers != NULL) {
+        pthread_mutex_lock(&pool.lock);
+        for (int i = 0; i < pool.worker_count; i++) {
+            if (pool.serving[i] != NULL) {
+                shutdown(pool.serving[i]->client_data.client_sockfd, SHUT_RDWR);
+            }
+        }
+        pthread_cond_broadcast(&pool.queued);
+        pthread_mutex_unlock(&pool.lock);
+
+        for (int i = 0; i < pool.worker_count; i++) {
+            if (pool.workers[i] == 0 || pthread_equal(pool.workers[i], pthread_self())) {
+                continue;
+            }
+            async_log(LOG_INFO, "cleanup - joining worker %d", i);
+            if (pthread_join(pool.workers[i], NULL) != 0) {
+                async_log(LOG_ERR, "cleanup - error joining thread!");
+                exit(EXIT_FAILURE);
+            }
         }
-        free(thread);
+    }
+
+    // Then the background threads. The ticker appends the timestamps, so
+    // the appender is stopped last, once nothing can queue behind it.
+    if (stats_sockfd >= 0) {
+        shutdown(stats_sockfd, SHUT_RDWR);
+    }
+    join_thread(ticker_thread, "timer");
+    join_thread(syncer_thread, "sync");
+    join_thread(stats_thread, "stats");
+    if (appender_thread != 0) {
+        __atomic_store_n(&append_stop, true, __ATOMIC_RELEASE);
+        sem_post(&append_wake);
+        join_thread(appender_thread, "appender");
     }
 
     // Close open sockets
-    if (sockfd >= 0) close(sockfd);
+    for (int i = 0; listeners != NULL && i < listener_count; i++) {
+        if (listeners[i].sockfd >= 0) close(listeners[i].sockfd);
+    }
+    if (stats_sockfd >= 0) {
+        close(stats_sockfd);
+        unlink(stats_path);
+    }
+
+    // Unmap the data file views
+    struct data_view_t *view = data_view;
+    while (view != NULL) {
+        struct data_view_t *prev = view->prev;
+        munmap((void *)view->base, view->len);
+        free(view);
+        view = prev;
+    }
+    data_view = NULL;
 
-    // Close file descriptors
-    if (datafd >= 0) close(datafd);
+    // Close file descriptors and delete the files
+    while (!TAILQ_EMPTY(&segments)) {
+        struct segment_t *seg = TAILQ_FIRST(&segments);
+        char path[PATH_MAX];
+        TAILQ_REMOVE(&segments, seg, entries);
+        segment_path(seg->seq, path, sizeof(path));
+        close(seg->fd);
+        remove(path);
+        free(seg);
+    }
+    record_index_free(&record_index);
+    if (replay_cache.buckets != NULL) {
+        chunk_cache_destroy(&replay_cache);
+    }
+    time_index_free(&time_index);
 
-    // Delete the file
-    remove("/var/tmp/aesdsocketdata");
+    // Report the lock stats, the threads are stopped
+    if (lock_prof_enabled) {
+        log_stats(false);
+    }
 
-    // Close syslog
+    // Flush the queued messages and close syslog
+    async_log_stop();
     closelog();
 
     // Exit
@@ -215,93 +1105,1821 @@ void cleanup(int exit_code) {
 }
 
 void sig_handler(int signo) {
+   if (signo == SIGUSR1) {
+       // Dumped by the main loop, outside the handler
+       stats_requested = 1;
+   }
    if (signo == SIGINT || signo == SIGTERM) {
-       syslog(LOG_INFO, "Caught signal, exiting");
-       cleanup(EXIT_SUCCESS);
+       // Only async-signal-safe calls here, the main loop runs cleanup()
+       async_log_signal(LOG_INFO, "Caught signal, exiting");
+       exit_requested = 1;
    }
 }
 
-void *connection(void *arg)
+// Fatal error on a thread that cleanup() joins, which must not run it
+// itself: wake the main loop to do it. Every other thread blocks SIGTERM.
+void request_exit(int exit_code)
 {
-    struct thread_info_t *thread_info = (struct thread_info_t *)arg;
-    client_info_t client_data = thread_info->client_data;
+    __atomic_store_n(&exit_status, exit_code, __ATOMIC_RELAXED);
+    exit_requested = 1;
+    kill(getpid(), SIGTERM);
+}
 
-    // Receive and process data
-    char* buffer = (char *)malloc(buffer_size * sizeof(char));
-    if (buffer == NULL) {
-        syslog(LOG_ERR, "ERROR: Failed to malloc");
-        cleanup(EXIT_FAILURE);
-    }
-    memset(buffer, 0, buffer_size * sizeof(char));
-    ssize_t recv_size;
+// Fatal error on a connection, accept or timer thread: leave the cleanup
+// to the main loop and end the thread, cleanup() then joins it
+void thread_fatal(void)
+{
+    request_exit(EXIT_FAILURE);
+    pthread_exit(NULL);
+}
 
-    while ((recv_size = recv(client_data.client_sockfd, buffer, buffer_size, 0)) > 0) {
-        // Append data to file ,Lock the mutex before writing
-        if (pthread_mutex_lock(&aesddata_file_mutex) != 0) {
-            syslog(LOG_ERR, "ERROR: Failed to acquire mutex!");
-            cleanup(EXIT_FAILURE);
-        }
-        if (write(datafd, buffer, recv_size) == -1) {
-            syslog(LOG_ERR, "ERROR: Failed to write to file");
-            cleanup(EXIT_FAILURE);
-        }
-        // Unlock the mutex after writing to the file
-        if (pthread_mutex_unlock(&aesddata_file_mutex) != 0) {
-            syslog(LOG_ERR, "ERROR: Failed to release mutex!");
-            cleanup(EXIT_FAILURE);
-        }
+// Pin the calling thread to one online CPU, picked by index (-a)
+void pin_thread(int index)
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus <= 0) return;
 
-        // Check for newline to consider the packet complete
-        if (memchr(buffer, '\n', buffer_size) != NULL) {
-            // Reset file offset to the beginning of the file
-            lseek(datafd, 0, SEEK_SET);
-            int bytes_read = read(datafd, buffer, buffer_size);
-            if (bytes_read == -1) {
-                syslog(LOG_ERR, "ERROR: Failed to read from file");
-                cleanup(EXIT_FAILURE);
-            }
-            while (bytes_read > 0) {
-                send(client_data.client_sockfd, buffer, bytes_read, 0);
-                bytes_read = read(datafd, buffer, buffer_size); 
-            }
-        }
-        memset(buffer, 0, buffer_size * sizeof(char));
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(index % ncpus, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        async_log(LOG_WARNING, "Failed to pin thread to CPU %ld", index % ncpus);
     }
+}
 
-    free(buffer);
+// An idle connection is shut down, which wakes the thread serving it to
+// close it as if the client had. A busy one is checked again later.
+static void idle_expire(struct wheel_timer_t *timer, uint64_t now)
+{
+    struct idle_t *idle = timer->arg;
+    uint64_t timeout = (uint64_t)idle_timeout_s * 1000 / timer_tick_ms;
+    uint64_t last = __atomic_load_n(&idle->last_active, __ATOMIC_RELAXED);
 
-    // Log closed connection
-    syslog(LOG_INFO, "Closed connection from %s", client_data.client_ip);
-    close(client_data.client_sockfd);
+    if (__atomic_load_n(&idle->busy, __ATOMIC_RELAXED)) {
+        timer_wheel_add(&timers, timer, now + timeout);
+    } else if (now - last < timeout) {
+        timer_wheel_add(&timers, timer, last + timeout);
+    } else {
+        async_log(LOG_INFO, "Closing connection idle for %d s", idle_timeout_s);
+        shutdown(idle->sockfd, SHUT_RDWR);
+    }
+}
 
-    thread_info->notification = 1;
-    return NULL;
+static void idle_touch(struct idle_t *idle)
+{
+    if (idle_timeout_s > 0) {
+        __atomic_store_n(&idle->last_active, __atomic_load_n(&timer_ticks, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    }
 }
 
-void *timestamp(void *arg) {
-    while (!signal_exit) {
-        time_t current_time = time(NULL);
-        struct tm *time_info = localtime(&current_time);
+static void idle_busy(struct idle_t *idle, bool busy)
+{
+    if (idle_timeout_s > 0) {
+        __atomic_store_n(&idle->busy, busy, __ATOMIC_RELAXED);
+        idle_touch(idle);
+    }
+}
 
-        char timestamp[100];
-        strftime(timestamp, sizeof(timestamp), "timestamp: %a, %d %b %Y %H:%M:%S %z\n", time_info);
+// Arm the idle timeout of a new connection
+void idle_start(struct idle_t *idle, int sockfd)
+{
+    if (idle_timeout_s == 0) return;
+    wheel_timer_init(&idle->timer, idle_expire, idle);
+    idle->sockfd = sockfd;
+    idle->busy = false;
+    idle_touch(idle);
+    prof_mutex_lock(&timers_mutex);
+    timer_wheel_add(&timers, &idle->timer, timer_ticks + (uint64_t)idle_timeout_s * 1000 / timer_tick_ms);
+    prof_mutex_unlock(&timers_mutex);
+}
 
-        // Append timestamp to /var/tmp/aesdsocketdata
-        // Lock the mutex before writing to the file
-        if (pthread_mutex_lock(&aesddata_file_mutex) != 0) {
-            syslog(LOG_ERR, "ERROR: Failed to acquire mutex!");
-            cleanup(EXIT_FAILURE);
-        }
-        write(datafd, timestamp, strlen(timestamp));
-        // Unlock the mutex after writing to the file
-        if (pthread_mutex_unlock(&aesddata_file_mutex) != 0) {
-            syslog(LOG_ERR, "ERROR: Failed to release mutex!");
-            cleanup(EXIT_FAILURE);
-        }
+// Disarm it before the socket is closed, so it never shuts down a reused fd
+static void idle_stop(struct idle_t *idle)
+{
+    if (idle_timeout_s == 0) return;
+    prof_mutex_lock(&timers_mutex);
+    timer_wheel_del(&timers, &idle->timer);
+    prof_mutex_unlock(&timers_mutex);
+}
+
+// Published end of the data file, see data_end
+static off_t published_end(void)
+{
+    return __atomic_load_n(&data_end, __ATOMIC_ACQUIRE);
+}
 
-        sleep(10); // Wait for 10 seconds before appending the next timestamp
+// Append len bytes of complete packets and wait until the appender has
+// written them. A failed write is fatal, the server cleans up and exits.
+static void append_checked(const char *data, size_t len)
+{
+    if (append_data(data, len) == -1) {
+        async_log(LOG_ERR, "ERROR: Failed to write to file");
+        thread_fatal();
+    }
+}
+
+// Append the first len bytes of the frame and drop them from it
+static void frame_append(struct frame_buf_t *frame, size_t len)
+{
+    append_checked(frame->data, len);
+    frame_consume(frame, len);
+}
+
+// Resolve an AESDCHAR_IOCSEEKTO:X,Y argument to the logical offset of
+// byte Y of record X through the record index.
+// Returns the offset, or -1 if the command is malformed or out of range.
+static off_t seek_offset(const char *args)
+{
+    char *end;
+    errno = 0;
+    unsigned long long record = strtoull(args, &end, 10);
+    if (end == args || *end != ',') return -1;
+    const char *num = end + 1;
+    unsigned long long byte = strtoull(num, &end, 10);
+    if (end == num || *end != '\0' || errno == ERANGE) return -1;
+
+    off_t start, stop;
+    prof_mutex_lock(&record_index_mutex);
+    int found = record_index_lookup(&record_index, record, &start, &stop);
+    prof_mutex_unlock(&record_index_mutex);
+    if (found == -1 || byte >= (unsigned long long)(stop - start)) return -1;
+    return start + byte;
+}
+
+// One end of a time range: Unix seconds, or seconds before now with a
+// leading '-'. Returns 0 on success, -1 if malformed.
+static int parse_range_time(const char *str, char **end, time_t *when)
+{
+    errno = 0;
+    long long value = strtoll(str, end, 10);
+    if (*end == str || errno == ERANGE) return -1;
+    *when = str[0] == '-' ? time(NULL) + value : (time_t)value;
+    return 0;
+}
+
+// Resolve an AESDCHAR_IOCTIMERANGE:FROM[,TO] argument to the byte range
+// holding the packets received between the two times, with a binary
+// search over the timestamp markers. The range is widened to the
+// enclosing markers, the timestamp interval is the resolution. Without
+// TO, or with no marker after it, the range runs to the end of the data.
+// Returns the start offset with *end set (-1 for the end of the data), or
+// -1 if the command is malformed.
+static off_t range_offsets(const char *args, off_t *end)
+{
+    char *rest;
+    time_t from, to = 0;
+    if (parse_range_time(args, &rest, &from) == -1) return -1;
+    bool bounded = *rest == ',';
+    if (bounded && parse_range_time(rest + 1, &rest, &to) == -1) return -1;
+    if (*rest != '\0' || (bounded && to < from)) return -1;
+
+    prof_mutex_lock(&record_index_mutex);
+    off_t start = time_index_floor(&time_index, from);
+    *end = bounded ? time_index_after(&time_index, to) : -1;
+    prof_mutex_unlock(&record_index_mutex);
+
+    // Before the oldest marker, start at the oldest data still kept
+    return start == -1 ? 0 : start;
+}
+
+static void pub_buf_put(struct pub_buf_t *buf)
+{
+    if (__atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        slab_free(buf, sizeof(struct pub_buf_t) + buf->len);
+    }
+}
+
+// Register a new subscriber with the appender.
+// Returns it, or NULL if it could not be set up.
+static struct subscriber_t *subscriber_new(void)
+{
+    struct subscriber_t *sub = calloc(1, sizeof(struct subscriber_t));
+    if (sub == NULL) return NULL;
+    sub->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (sub->wakefd == -1) {
+        free(sub);
+        return NULL;
+    }
+    pthread_mutex_init(&sub->lock, NULL);
+
+    prof_mutex_lock(&subscribers_mutex);
+    LIST_INSERT_HEAD(&subscribers, sub, entries);
+    __atomic_add_fetch(&subscriber_count, 1, __ATOMIC_RELEASE);
+    prof_mutex_unlock(&subscribers_mutex);
+    return sub;
+}
+
+// Unregister a subscriber and drop what it still had queued
+static void subscriber_free(struct subscriber_t *sub)
+{
+    prof_mutex_lock(&subscribers_mutex);
+    LIST_REMOVE(sub, entries);
+    __atomic_sub_fetch(&subscriber_count, 1, __ATOMIC_RELEASE);
+    prof_mutex_unlock(&subscribers_mutex);
+
+    while (sub->count > 0) {
+        pub_buf_put(sub->queue[sub->head]);
+        sub->head = (sub->head + 1) % sub_queue_len;
+        sub->count--;
+    }
+    close(sub->wakefd);
+    pthread_mutex_destroy(&sub->lock);
+    free(sub);
+}
+
+// Hand an appended batch to every subscriber. Appender only, in append order.
+static void publish(struct append_req_t *first, struct append_req_t *last, size_t total)
+{
+    // Freed by whichever subscriber drops it last, the slab depot brings it back
+    struct pub_buf_t *buf = slab_alloc(sizeof(struct pub_buf_t) + total);
+    if (buf == NULL) {
+        async_log(LOG_ERR, "ERROR: Failed to malloc");
+        append_fail();
+        return;
+    }
+    buf->refs = 1;
+    buf->len = total;
+    size_t pos = 0;
+    for (struct append_req_t *r = first; r != last; r = r->next) {
+        memcpy(buf->data + pos, r->data, r->len);
+        pos += r->len;
+    }
+
+    prof_mutex_lock(&subscribers_mutex);
+    struct subscriber_t *sub;
+    LIST_FOREACH(sub, &subscribers, entries) {
+        prof_mutex_lock(&sub->lock);
+        bool wake = sub->count == 0;
+        if (sub->overflow) {
+            wake = false;
+        } else if (sub->count == sub_queue_len || sub->queued_bytes + total > sub_max_bytes) {
+            // Too far behind, the owner drops the connection
+            sub->overflow = true;
+            wake = true;
+        } else {
+            __atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+            sub->queue[(sub->head + sub->count) % sub_queue_len] = buf;
+            sub->count++;
+            sub->queued_bytes += total;
+        }
+        prof_mutex_unlock(&sub->lock);
+        if (wake) {
+            uint64_t one = 1;
+            if (write(sub->wakefd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+                async_log(LOG_WARNING, "Failed to wake subscriber");
+            }
+        }
+    }
+    prof_mutex_unlock(&subscribers_mutex);
+    pub_buf_put(buf);
+}
+
+// Send what is queued for a subscriber, the shared buffers go out with
+// scatter/gather I/O and no copy. Only the owner takes buffers off the
+// queue, so they stay valid while sendmsg runs without the lock.
+// Returns 1 when the queue is empty, 0 when the socket is full and -1 when
+// the client is gone or fell too far behind.
+static int subscriber_flush(int client_sockfd, struct subscriber_t *sub)
+{
+    uint64_t wakeups;
+    if (read(sub->wakefd, &wakeups, sizeof(wakeups)) == -1 && errno != EAGAIN) {
+        return -1;
+    }
+
+    while (1) {
+        struct iovec iov[IOV_MAX];
+        int iovcnt = 0;
+        prof_mutex_lock(&sub->lock);
+        bool overflow = sub->overflow;
+        for (size_t i = 0; i < sub->count && iovcnt < IOV_MAX; i++) {
+            struct pub_buf_t *buf = sub->queue[(sub->head + i) % sub_queue_len];
+            size_t skip = i == 0 ? sub->sent : 0;
+            iov[iovcnt].iov_base = buf->data + skip;
+            iov[iovcnt].iov_len = buf->len - skip;
+            iovcnt++;
+        }
+        prof_mutex_unlock(&sub->lock);
+        if (overflow) return -1;
+        if (iovcnt == 0) return 1;
+
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+        // Never block, even on a blocking socket: a stalled subscriber must still see its overflow
+        ssize_t sent = sendmsg(client_sockfd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent == -1) {
+            if (errno == EINTR) continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+
+        metrics_add(METRIC_BYTES_OUT, sent);
+        // Release what went out, resume a partial send mid-buffer
+        prof_mutex_lock(&sub->lock);
+        while (sent > 0) {
+            struct pub_buf_t *buf = sub->queue[sub->head];
+            size_t left = buf->len - sub->sent;
+            if ((size_t)sent < left) {
+                sub->sent += sent;
+                break;
+            }
+            sent -= left;
+            sub->sent = 0;
+            sub->head = (sub->head + 1) % sub_queue_len;
+            sub->count--;
+            sub->queued_bytes -= buf->len;
+            pub_buf_put(buf);
+        }
+        prof_mutex_unlock(&sub->lock);
+    }
+}
+
+void session_init(struct session_t *session)
+{
+    memset(session, 0, sizeof(*session));
+    session->queued_end = -1;
+}
+
+// Switch the session to delta replays. An empty argument asks for a new
+// token, otherwise the cursor kept under the given token is resumed; an
+// unknown token (evicted, or from before a restart) starts from the
+// beginning. Returns 0 on success, -1 if the token is malformed.
+static int session_delta(struct session_t *session, const char *args)
+{
+    uint64_t token;
+    off_t cursor = 0;
+
+    if (args[0] == '\0') {
+        if (getrandom(&token, sizeof(token), 0) != sizeof(token)) {
+            token = ((uint64_t)time(NULL) << 32) ^ (uintptr_t)session;
+        }
+    } else {
+        char *end;
+        errno = 0;
+        token = strtoull(args, &end, 16);
+        if (*end != '\0' || errno == ERANGE) return -1;
+
+        prof_mutex_lock(&delta_cursors_mutex);
+        for (int i = 0; i < delta_token_max; i++) {
+            if (delta_cursors[i].used != 0 && delta_cursors[i].token == token) {
+                cursor = delta_cursors[i].cursor;
+                break;
+            }
+        }
+        prof_mutex_unlock(&delta_cursors_mutex);
+    }
+
+    session->delta = true;
+    session->token = token;
+    session->cursor = cursor;
+    session->queued_end = -1;
+    session->reply_len = snprintf(session->reply, sizeof(session->reply),
+                                  delta_cmd "%016" PRIx64 "\n", token);
+    session->reply_sent = 0;
+    return 0;
+}
+
+// A replay is about to send its first byte
+static void replay_started(struct replay_t *replay)
+{
+    if (replay->started_ns == 0) {
+        replay->started_ns = metrics_now();
+        metrics_record(METRIC_APPEND_TO_REPLAY, replay->started_ns - replay->queued_ns);
+    }
+}
+
+static void replay_finished(const struct replay_t *replay)
+{
+    metrics_record(METRIC_REPLAY_TIME, metrics_now() - replay->started_ns);
+}
+
+// Bytes of a replay that went out
+static void replay_sent(size_t len)
+{
+    metrics_add(METRIC_REPLAY_BYTES, len);
+    metrics_add(METRIC_BYTES_OUT, len);
+}
+
+// A replay finished, a delta replay moves the cursor to where it ended
+static void session_replayed(struct session_t *session, const struct replay_t *replay)
+{
+    if (replay->cursor_end >= 0) {
+        session->cursor = replay->cursor_end;
+        if (session->queued_end == replay->cursor_end) {
+            session->queued_end = -1;
+        }
+    }
+}
+
+// Keep the cursor of a closing delta session for a later resume
+static void session_close(struct session_t *session)
+{
+    if (session->sub != NULL) {
+        subscriber_free(session->sub);
+        session->sub = NULL;
+    }
+    if (!session->delta) return;
+
+    prof_mutex_lock(&delta_cursors_mutex);
+    int slot = 0;
+    for (int i = 0; i < delta_token_max; i++) {
+        if (delta_cursors[i].used != 0 && delta_cursors[i].token == session->token) {
+            slot = i;
+            break;
+        }
+        if (delta_cursors[i].used < delta_cursors[slot].used) {
+            slot = i;
+        }
+    }
+    delta_cursors[slot].token = session->token;
+    delta_cursors[slot].cursor = session->cursor;
+    delta_cursors[slot].used = ++delta_clock;
+    prof_mutex_unlock(&delta_cursors_mutex);
+}
+
+// Send what is left of the handshake reply.
+// Returns 1 once it is sent, 0 when a non-blocking socket is full and -1
+// when the client is gone, like replay_file().
+static int send_reply(int client_sockfd, struct session_t *session)
+{
+    while (session->reply_sent < session->reply_len) {
+        ssize_t sent = send(client_sockfd, session->reply + session->reply_sent,
+                            session->reply_len - session->reply_sent, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        session->reply_sent += sent;
+        metrics_add(METRIC_BYTES_OUT, sent);
+    }
+    return 1;
+}
+
+// Run an AESDCHAR_IOC* control packet.
+// Returns the offset the replay starts from with *end set (-1 for the end
+// of the data) and *full set for a replay of everything, or -1 if the
+// command is malformed, unknown or out of range.
+static off_t run_command(const char *packet, size_t len, struct session_t *session, off_t *end, bool *full)
+{
+    char args[64];
+    const char *colon = memchr(packet, ':', len);
+    if (colon == NULL) return -1;
+    size_t args_len = packet + len - 1 - (colon + 1);
+    if (args_len >= sizeof(args)) return -1;
+    memcpy(args, colon + 1, args_len);
+    args[args_len] = '\0';
+
+    *end = -1;
+    *full = false;
+    size_t name_len = colon + 1 - packet;
+    if (name_len == strlen(delta_cmd) && memcmp(packet, delta_cmd, name_len) == 0) {
+        // The handshake is answered with the token and what the client missed
+        *full = true;
+        return session_delta(session, args);
+    }
+    if (name_len == strlen(subscribe_cmd) && memcmp(packet, subscribe_cmd, name_len) == 0) {
+        if (args[0] != '\0') return -1;
+        if (session->sub == NULL && (session->sub = subscriber_new()) == NULL) {
+            async_log(LOG_ERR, "ERROR: Failed to set up subscriber");
+            return -1;
+        }
+        return 0;
+    }
+    if (name_len == strlen(seek_cmd) && memcmp(packet, seek_cmd, name_len) == 0) {
+        return seek_offset(args);
+    }
+    if (name_len == strlen(range_cmd) && memcmp(packet, range_cmd, name_len) == 0) {
+        return range_offsets(args, end);
+    }
+    return -1;
+}
+
+// Account recv_size new bytes in the frame and append every complete
+// packet straight from it. AESDCHAR_IOC* control packets are not stored,
+// they pick the range of the replay that follows them: from byte Y of
+// record X for AESDCHAR_IOCSEEKTO:X,Y, between two times for
+// AESDCHAR_IOCTIMERANGE:FROM[,TO]. In a delta session a replay of
+// everything starts at the session cursor instead; a subscribed session
+// gets no replays. A malformed, unknown or out of range command is
+// ordinary data.
+// A packet that reaches frame_max bytes without a newline is appended in
+// pieces as it arrives, so the packets of other clients may land between
+// them. That bounds what a client can make the server hold.
+// Returns true with *replay set when a replay is due.
+static bool frame_received(struct frame_buf_t *frame, size_t recv_size, struct session_t *session,
+                           struct replay_t *replay)
+{
+    uint64_t received_ns = metrics_now();
+    size_t complete = frame_commit(frame, recv_size);
+    metrics_add(METRIC_BYTES_IN, recv_size);
+    if (complete == 0) {
+        // An oversize line is written as it arrives, as it was before framing
+        if (frame->len >= frame_max) {
+            frame_append(frame, frame->len);
+        }
+        return false;
+    }
+
+    off_t replay_end = -1;
+    off_t replay_from = 0;
+    bool full = true;
+    bool appended = true;
+    // The framing counted the packets, and those that may be commands
+    metrics_add(METRIC_PACKETS, frame->packets);
+    if (frame->marked == 0) {
+        frame_append(frame, complete);
+    } else {
+        appended = false;
+        // Append the runs of packets between the commands, the last packet decides the replay
+        size_t pending = 0, pos = 0;
+        while (pos < complete) {
+            const char *packet = frame->data + pos;
+            size_t len = (const char *)memchr(packet, '\n', complete - pos) - packet + 1;
+            if (len > strlen(cmd_prefix) && memcmp(packet, cmd_prefix, strlen(cmd_prefix)) == 0) {
+                if (pos > pending) {
+                    append_checked(frame->data + pending, pos - pending);
+                    appended = true;
+                }
+                pending = pos;
+                replay_from = run_command(packet, len, session, &replay_end, &full);
+                if (replay_from != -1) {
+                    pending = pos + len;
+                } else {
+                    // Stored as ordinary data and answered with a full replay, as before the commands
+                    async_log(LOG_WARNING, "Storing invalid command %.*s as data", (int)(len - 1), packet);
+                    replay_from = 0;
+                    replay_end = -1;
+                    full = true;
+                }
+            } else {
+                replay_from = 0;
+                replay_end = -1;
+                full = true;
+            }
+            pos += len;
+        }
+        if (complete > pending) {
+            append_checked(frame->data + pending, complete - pending);
+            appended = true;
+        }
+        frame_consume(frame, complete);
+    }
+    uint64_t appended_ns = metrics_now();
+    if (appended) {
+        metrics_record(METRIC_RECV_TO_APPEND, appended_ns - received_ns);
+    }
+
+    // Subscribers get the appended batches, never replays
+    if (replay_from == -1 || session->sub != NULL) {
+        return false;
+    }
+    replay->off = replay_from;
+    replay->end = replay_end >= 0 ? replay_end : published_end();
+    replay->cursor_end = -1;
+    replay->queued_ns = appended_ns;
+    replay->started_ns = 0;
+    metrics_add(METRIC_REPLAYS, 1);
+    if (full && session->delta) {
+        // Continue after the delta replays still queued, if any
+        replay->off = session->queued_end >= 0 ? session->queued_end : session->cursor;
+        replay->cursor_end = replay->end;
+        session->queued_end = replay->end;
+    }
+    return true;
+}
+
+// Room for the next recv in the frame
+static char *frame_recv_space(struct frame_buf_t *frame, size_t *avail)
+{
+    char *space = frame_space(frame, avail);
+    if (space == NULL) {
+        async_log(LOG_ERR, "ERROR: Failed to malloc");
+        thread_fatal();
+    }
+    return space;
+}
+
+// Link a timeout of send_timeout_ms (-O) to the SEND just queued on @ring.
+// io_uring ignores SO_SNDTIMEO, so this is what fails a receiver that stops
+// reading: its SEND and the rest of the chain complete with -ECANCELED and
+// the timeout with -ETIME. Returns the entries queued, 0 without a timeout.
+static unsigned uring_send_timeout(struct uring_t *ring, const struct __kernel_timespec *ts)
+{
+    if (send_timeout_ms <= 0) return 0;
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->addr = (unsigned long)ts;
+    sqe->len = 1;
+    sqe->user_data = uring_timeout_tag;
+    return 1;
+}
+
+// Replay the data from off to end with linked SENDs straight out of the
+// shared chunk cache, uring_buf_count chunks per io_uring_enter.
+// Concurrent replays at the same published end send the same chunks, read
+// from the file once. Data the cache can't load (dropped by retention
+// meanwhile) is left to replay_file(). Returns false if the client is gone.
+static bool replay_cached(struct uring_t *ring, int client_sockfd, off_t off, off_t end)
+{
+    struct __kernel_timespec timeout = {
+        .tv_sec = send_timeout_ms / 1000, .tv_nsec = (long long)(send_timeout_ms % 1000) * 1000000,
+    };
+
+    while (off < end) {
+        const struct chunk_t *chunks[uring_buf_count];
+        off_t starts[uring_buf_count];
+        size_t lens[uring_buf_count];
+        bool sent[uring_buf_count];
+        unsigned count = 0, entries = 0;
+
+        for (unsigned i = 0; i < uring_buf_count && off < end; i++, count++) {
+            const struct chunk_t *chunk = chunk_cache_get(&replay_cache, off, end);
+            if (chunk == NULL) break;
+            chunks[i] = chunk;
+            starts[i] = off;
+            lens[i] = chunk->start + chunk->len - off;
+            sent[i] = false;
+            off += lens[i];
+
+            // Linked, so the chunks reach the socket in order
+            struct io_uring_sqe *sqe = uring_get_sqe(ring);
+            sqe->opcode = IORING_OP_SEND;
+            sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+            sqe->fd = 0;
+            sqe->addr = (unsigned long)(chunk->data + (starts[i] - chunk->start));
+            sqe->len = lens[i];
+            // MSG_MORE until the last chunk: separate sub-MSS sends would wait on
+            // Nagle for the delayed ACK of the one before, 40 ms each
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (off < end ? MSG_MORE : 0);
+            sqe->user_data = i;
+            entries += 1 + uring_send_timeout(ring, &timeout);
+        }
+        if (count == 0) {
+            return replay_file(client_sockfd, &off, end) != -1;
+        }
+        ring->sqes[(ring->sqe_tail - 1) & *ring->sq_mask].flags &= ~IOSQE_IO_LINK;
+
+        bool client_gone = false;
+        unsigned pending = entries;
+        if (uring_submit_and_wait(ring, entries) < 0) {
+            async_log(LOG_ERR, "ERROR: io_uring submit failed");
+            pending = 0;
+            client_gone = true;
+        }
+        // Reap every send before the chunks are released, the kernel reads from them
+        for (unsigned c = 0; c < pending; c++) {
+            struct io_uring_cqe *cqe = uring_wait_cqe(ring);
+            if (cqe == NULL) {
+                async_log(LOG_ERR, "ERROR: io_uring wait failed");
+                return false;
+            }
+            uint64_t user_data = cqe->user_data;
+            unsigned i = user_data;
+            int res = cqe->res;
+            uring_cqe_seen(ring);
+
+            if (user_data == uring_timeout_tag) {
+                if (res == -ETIME) client_gone = true;
+                continue;
+            }
+            if (res == -ECANCELED) continue;
+            if (res < 0) {
+                client_gone = true;
+                continue;
+            }
+            // A short send breaks the chain, finish this chunk synchronously
+            const char *data = chunks[i]->data + (starts[i] - chunks[i]->start);
+            while ((size_t)res < lens[i] && !client_gone) {
+                ssize_t n = send(client_sockfd, data + res, lens[i] - res, MSG_NOSIGNAL);
+                if (n <= 0) {
+                    client_gone = true;
+                    break;
+                }
+                res += n;
+            }
+            sent[i] = (size_t)res == lens[i];
+            replay_sent(res);
+        }
+        for (unsigned i = 0; i < count; i++) {
+            chunk_cache_put(&replay_cache, chunks[i]);
+        }
+        if (client_gone) return false;
+
+        // Resume after the last chunk that went out, if the chain was cut short
+        for (unsigned i = 0; i < count; i++) {
+            if (!sent[i]) {
+                if (i == 0) return false;
+                off = starts[i];
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+// Replay the data file from off to end with chains of linked
+// READ_FIXED -> SEND pairs, uring_buf_count pairs per io_uring_enter.
+// Returns false if the client is gone.
+static bool replay_uring(struct uring_t *ring, struct iovec *iovs, int client_sockfd, off_t off, off_t end)
+{
+    if (cache_bytes > 0) {
+        return replay_cached(ring, client_sockfd, off, end);
+    }
+
+    // The fixed file is the first segment only, stream rotating segments with sendfile
+    if (segment_size > 0) {
+        return replay_file(client_sockfd, &off, end) != -1;
+    }
+
+    struct __kernel_timespec timeout = {
+        .tv_sec = send_timeout_ms / 1000, .tv_nsec = (long long)(send_timeout_ms % 1000) * 1000000,
+    };
+
+    while (off < end) {
+        off_t starts[uring_buf_count];
+        size_t lens[uring_buf_count];
+        bool sent[uring_buf_count];
+        unsigned pairs = 0, entries = 0;
+
+        for (unsigned i = 0; i < uring_buf_count && off < end; i++, pairs++) {
+            size_t len = end - off < uring_buf_size ? end - off : uring_buf_size;
+            starts[i] = off;
+            lens[i] = len;
+            sent[i] = false;
+            off += len;
+
+            struct io_uring_sqe *sqe = uring_get_sqe(ring);
+            sqe->opcode = IORING_OP_READ_FIXED;
+            sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+            sqe->fd = 1;
+            sqe->addr = (unsigned long)iovs[i].iov_base;
+            sqe->len = len;
+            sqe->off = starts[i];
+            sqe->buf_index = i;
+            sqe->user_data = i << 1;
+
+            // Sends are linked too, so the chunks reach the socket in order
+            sqe = uring_get_sqe(ring);
+            sqe->opcode = IORING_OP_SEND;
+            sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+            sqe->fd = 0;
+            sqe->addr = (unsigned long)iovs[i].iov_base;
+            sqe->len = len;
+            // MSG_MORE until the last chunk, as in replay_cached()
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (off < end ? MSG_MORE : 0);
+            sqe->user_data = (i << 1) | 1;
+            entries += 2 + uring_send_timeout(ring, &timeout);
+        }
+        ring->sqes[(ring->sqe_tail - 1) & *ring->sq_mask].flags &= ~IOSQE_IO_LINK;
+
+        if (uring_submit_and_wait(ring, entries) < 0) {
+            async_log(LOG_ERR, "ERROR: io_uring submit failed");
+            return false;
+        }
+
+        bool client_gone = false;
+        for (unsigned c = 0; c < entries; c++) {
+            struct io_uring_cqe *cqe = uring_wait_cqe(ring);
+            if (cqe == NULL) {
+                async_log(LOG_ERR, "ERROR: io_uring wait failed");
+                return false;
+            }
+            uint64_t user_data = cqe->user_data;
+            unsigned i = user_data >> 1;
+            int res = cqe->res;
+            bool is_send = user_data & 1;
+            uring_cqe_seen(ring);
+
+            if (user_data == uring_timeout_tag) {
+                if (res == -ETIME) client_gone = true;
+                continue;
+            }
+            if (res == -ECANCELED) continue;
+            if (!is_send) {
+                if (res < 0) {
+                    async_log(LOG_ERR, "ERROR: Failed to read from file");
+                    thread_fatal();
+                }
+                continue;
+            }
+            if (res < 0) {
+                client_gone = true;
+                continue;
+            }
+            // A short send breaks the chain, finish this chunk synchronously
+            while ((size_t)res < lens[i]) {
+                ssize_t n = send(client_sockfd, (char *)iovs[i].iov_base + res, lens[i] - res, MSG_NOSIGNAL);
+                if (n <= 0) return false;
+                res += n;
+            }
+            sent[i] = true;
+            replay_sent(res);
+        }
+        if (client_gone) return false;
+
+        // Resume after the last chunk that went out, if the chain was cut short
+        for (unsigned i = 0; i < pairs; i++) {
+            if (!sent[i]) {
+                if (i == 0) return false;
+                off = starts[i];
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+// Serve a subscribed connection on a blocking socket: forward the batches
+// as they are appended, and keep appending what the client sends.
+static void subscriber_serve(int client_sockfd, struct frame_buf_t *frame, struct session_t *session,
+                             struct idle_t *idle)
+{
+    struct pollfd fds[2] = {
+        { .fd = client_sockfd, .events = POLLIN },
+        { .fd = session->sub->wakefd, .events = POLLIN },
+    };
+
+    while (1) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        idle_touch(idle);
+        // Wait for room in the socket while the feed is backed up
+        if (fds[1].revents & POLLIN || fds[0].revents & POLLOUT) {
+            int rc = subscriber_flush(client_sockfd, session->sub);
+            if (rc == -1) return;
+            fds[0].events = rc == 0 ? POLLIN | POLLOUT : POLLIN;
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            size_t avail;
+            char *space = frame_recv_space(frame, &avail);
+            ssize_t recv_size = recv(client_sockfd, space, avail, 0);
+            if (recv_size <= 0) return;
+            struct replay_t replay;
+            frame_received(frame, recv_size, session, &replay);
+        }
+    }
+}
+
+// Serve a client with io_uring: the socket and datafd are fixed files and
+// the buffers are registered once per connection. Returns false, before
+// touching the socket, if the ring can't be set up.
+static bool connection_uring(client_info_t *client_data, struct idle_t *idle)
+{
+    struct uring_t ring;
+    struct iovec iovs[uring_buf_count];
+    int files[2] = { client_data->client_sockfd, datafd };
+
+    // A read, a send and the send's timeout per buffer
+    if (uring_init(&ring, 3 * uring_buf_count) != 0) {
+        return false;
+    }
+    char *buffers = slab_alloc(uring_buf_count * uring_buf_size);
+    if (buffers == NULL) {
+        uring_exit(&ring);
+        return false;
+    }
+    for (int i = 0; i < uring_buf_count; i++) {
+        iovs[i].iov_base = buffers + i * uring_buf_size;
+        iovs[i].iov_len = uring_buf_size;
+    }
+    if (uring_register_files(&ring, files, 2) != 0 ||
+        uring_register_buffers(&ring, iovs, uring_buf_count) != 0) {
+        async_log(LOG_WARNING, "io_uring registration failed, using blocking syscalls");
+        uring_exit(&ring);
+        slab_free(buffers, uring_buf_count * uring_buf_size);
+        return false;
+    }
+
+    struct frame_buf_t frame;
+    if (frame_init(&frame, uring_buf_size) == -1) {
+        async_log(LOG_ERR, "ERROR: Failed to malloc");
+        thread_fatal();
+    }
+    struct session_t session;
+    session_init(&session);
+
+    while (1) {
+        size_t avail;
+        struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+        sqe->opcode = IORING_OP_RECV;
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->fd = 0;
+        sqe->addr = (unsigned long)frame_recv_space(&frame, &avail);
+        sqe->len = avail;
+        if (uring_submit_and_wait(&ring, 1) < 0) break;
+        struct io_uring_cqe *cqe = uring_wait_cqe(&ring);
+        if (cqe == NULL) break;
+        int recv_size = cqe->res;
+        uring_cqe_seen(&ring);
+        if (recv_size <= 0) break;
+        idle_touch(idle);
+
+        // Replay once complete packets are in the file
+        struct replay_t replay;
+        if (frame_received(&frame, recv_size, &session, &replay)) {
+            idle_busy(idle, true);
+            replay_started(&replay);
+            bool sent = send_reply(client_data->client_sockfd, &session) == 1 &&
+                        replay_uring(&ring, iovs, client_data->client_sockfd, replay.off, replay.end);
+            idle_busy(idle, false);
+            if (!sent) break;
+            replay_finished(&replay);
+            session_replayed(&session, &replay);
+        }
+        if (session.sub != NULL) {
+            subscriber_serve(client_data->client_sockfd, &frame, &session, idle);
+            break;
+        }
+    }
+
+    // Keep an unterminated tail, as it was before framing
+    if (frame.len > 0) {
+        frame_append(&frame, frame.len);
+    }
+    frame_free(&frame);
+    session_close(&session);
+    uring_exit(&ring);
+    slab_free(buffers, uring_buf_count * uring_buf_size);
+    return true;
+}
+
+// Send the data file from *offset up to end straight from the page cache,
+// with send() from the shared mapping in -m mode or sendfile() from each
+// segment otherwise.
+// Like pread(), the offset is private to the caller, so the shared file
+// offset of datafd is never moved.
+// Returns 1 once end is reached, 0 when a non-blocking socket is full and
+// -1 when the client is gone.
+static int replay_file(int client_sockfd, off_t *offset, off_t end)
+{
+    const struct data_view_t *view = mmap_mode ? __atomic_load_n(&data_view, __ATOMIC_ACQUIRE) : NULL;
+    bool mapped = view != NULL && (off_t)view->len >= end;
+
+    while (*offset < end) {
+        struct segment_t *seg = NULL;
+        off_t seg_end = end;
+        off_t local = *offset;
+        if (!mapped) {
+            // Take the segment holding the offset, skipping data past retention
+            seg = segment_get(*offset);
+            if (seg == NULL) return 1;
+            if (*offset < seg->base) *offset = seg->base;
+            off_t len = __atomic_load_n(&seg->len, __ATOMIC_ACQUIRE);
+            if (seg->base + len < seg_end) seg_end = seg->base + len;
+            local = *offset - seg->base;
+        }
+
+        int rc = 1;
+        while (*offset < seg_end) {
+            size_t count = seg_end - *offset < replay_chunk ? seg_end - *offset : replay_chunk;
+            ssize_t sent;
+            if (mapped) {
+                sent = send(client_sockfd, view->base + *offset, count, MSG_NOSIGNAL);
+            } else {
+                sent = sendfile(client_sockfd, seg->fd, &local, count);
+            }
+            if (sent == 0) {
+                *offset = seg_end;
+                break;
+            }
+            if (sent == -1) {
+                if (errno == EINTR) continue;
+                rc = (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+                break;
+            }
+            *offset += sent;
+            replay_sent(sent);
+        }
+        if (seg != NULL) segment_put(seg);
+        if (rc != 1) return rc;
+    }
+    return 1;
+}
+
+static void connection(client_info_t client_data, struct idle_t *idle)
+{
+    if (uring_mode && connection_uring(&client_data, idle)) {
+        goto closed;
+    }
+
+    // Receive and process data
+    struct frame_buf_t frame;
+    if (frame_init(&frame, buffer_size) == -1) {
+        async_log(LOG_ERR, "ERROR: Failed to malloc");
+        thread_fatal();
+    }
+    struct session_t session;
+    session_init(&session);
+    ssize_t recv_size;
+    size_t avail;
+    char *space;
+
+    while ((space = frame_recv_space(&frame, &avail)) != NULL &&
+           (recv_size = recv(client_data.client_sockfd, space, avail, 0)) > 0) {
+        idle_touch(idle);
+        // Complete packets are appended, then replayed from the beginning of the file
+        // or from where a seek command points
+        struct replay_t replay;
+        if (frame_received(&frame, recv_size, &session, &replay)) {
+            idle_busy(idle, true);
+            replay_started(&replay);
+            bool sent = send_reply(client_data.client_sockfd, &session) == 1 &&
+                        replay_file(client_data.client_sockfd, &replay.off, replay.end) == 1;
+            idle_busy(idle, false);
+            if (!sent) break;
+            replay_finished(&replay);
+            session_replayed(&session, &replay);
+        }
+        if (session.sub != NULL) {
+            subscriber_serve(client_data.client_sockfd, &frame, &session, idle);
+            break;
+        }
+    }
+
+    // Keep an unterminated tail, as it was before framing
+    if (frame.len > 0) {
+        frame_append(&frame, frame.len);
+    }
+    frame_free(&frame);
+    session_close(&session);
+
+closed:
+    // Log closed connection
+    async_log(LOG_INFO, "Closed connection from %s", client_data.client_ip);
+}
+
+// Pool worker: serve queued connections until cleanup. Finishing a
+// connection just returns its context to the free list, nothing to join.
+void *worker(void *arg)
+{
+    int id = (intptr_t)arg;
+
+    pthread_mutex_lock(&pool.lock);
+    while (!signal_exit) {
+        if (pool.queue_len == 0) {
+            pthread_cond_wait(&pool.queued, &pool.lock);
+            continue;
+        }
+        struct conn_ctx_t *ctx = pool.queue[pool.queue_head];
+        pool.queue_head = (pool.queue_head + 1) % pool.queue_cap;
+        pool.queue_len--;
+        pool.serving[id] = ctx;
+        pthread_mutex_unlock(&pool.lock);
+
+        idle_start(&ctx->idle, ctx->client_data.client_sockfd);
+        connection(ctx->client_data, &ctx->idle);
+        idle_stop(&ctx->idle);
+
+        // Closed under the pool lock so cleanup never shuts down a reused fd
+        pthread_mutex_lock(&pool.lock);
+        pool.serving[id] = NULL;
+        close(ctx->client_data.client_sockfd);
+        SLIST_INSERT_HEAD(&pool.free_ctxs, ctx, entries);
+        pthread_cond_signal(&pool.ctx_freed);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    return NULL;
+}
+
+static void close_conn(struct event_loop_t *loop, struct conn_t *conn)
+{
+    // Log closed connection
+    async_log(LOG_INFO, "Closed connection from %s", conn->client_data.client_ip);
+    idle_stop(&conn->idle);
+    epoll_ctl(loop->epollfd, EPOLL_CTL_DEL, conn->client_data.client_sockfd, NULL);
+    close(conn->client_data.client_sockfd);
+    prof_mutex_lock(&loop->conn_list_mutex);
+    LIST_REMOVE(conn, entries);
+    prof_mutex_unlock(&loop->conn_list_mutex);
+    // Keep an unterminated tail, as it was before framing
+    if (conn->frame.len > 0) {
+        frame_append(&conn->frame, conn->frame.len);
+    }
+    frame_free(&conn->frame);
+    session_close(&conn->session);
+    slab_free(conn, sizeof(*conn));
+}
+
+// Send the queued replays on a non-blocking socket, in order.
+// Returns 1 when the queue is empty, 0 when the socket is full (resume on
+// the next EPOLLOUT) and -1 when the connection failed.
+static int replay_conn(struct conn_t *conn)
+{
+    int rc = send_reply(conn->client_data.client_sockfd, &conn->session);
+    while (rc == 1 && conn->out_count > 0) {
+        struct replay_t *replay = &conn->out[conn->out_head];
+        replay_started(replay);
+        rc = replay_file(conn->client_data.client_sockfd, &replay->off, replay->end);
+        if (rc == 1) {
+            replay_finished(replay);
+            session_replayed(&conn->session, replay);
+            conn->out_head = (conn->out_head + 1) % out_queue_len;
+            conn->out_count--;
+        }
+    }
+    return rc;
+}
+
+// Bytes left to send over the whole output queue
+static off_t out_pending(const struct conn_t *conn)
+{
+    off_t pending = 0;
+    for (unsigned i = 0; i < conn->out_count; i++) {
+        const struct replay_t *replay = &conn->out[(conn->out_head + i) % out_queue_len];
+        pending += replay->end - replay->off;
+    }
+    return pending;
+}
+
+// Drop the replays queued between the one in progress and the newest,
+// which answers the client's latest packet and is kept: it may be the
+// last one the client sends. A full replay already covers the dropped
+// ones, a delta replay is extended back to where the first of them began.
+static void out_drop(struct conn_t *conn)
+{
+    if (conn->out_count <= 2) return;
+    struct replay_t *first = &conn->out[(conn->out_head + 1) % out_queue_len];
+    struct replay_t newest = conn->out[(conn->out_head + conn->out_count - 1) % out_queue_len];
+    if (newest.cursor_end != -1 && first->cursor_end != -1) {
+        newest.off = first->off;
+    }
+    newest.queued_ns = first->queued_ns;
+    *first = newest;
+    conn->out_count = 2;
+}
+
+// Apply the output policy once the queue is over its high watermark.
+// Returns false when the connection should be closed.
+static bool out_backpressure(struct conn_t *conn)
+{
+    if (conn->out_count < out_queue_len && out_pending(conn) <= out_high) {
+        return true;
+    }
+    switch (out_policy) {
+    case OUT_PAUSE:
+        conn->paused = true;
+        return true;
+    case OUT_DROP:
+        out_drop(conn);
+        return true;
+    case OUT_DISCONNECT:
+    default:
+        async_log(LOG_WARNING, "Disconnecting %s, output backlog over %lld bytes",
+               conn->client_data.client_ip, (long long)out_high);
+        return false;
+    }
+}
+
+// Handle readiness on a client socket, or on its subscriber feed. Edge
+// triggered, so input is read until EAGAIN unless a replay blocks on a
+// full socket first.
+// Returns false when the connection should be closed.
+static bool service_conn(struct event_loop_t *loop, struct conn_t *conn)
+{
+    // Any event is progress, so the loop never calls a connection idle while it is served
+    idle_touch(&conn->idle);
+    if (replay_conn(conn) == -1) {
+        return false;
+    }
+    // A full socket resumes the feed on EPOLLOUT
+    if (conn->session.sub != NULL &&
+        subscriber_flush(conn->client_data.client_sockfd, conn->session.sub) == -1) {
+        return false;
+    }
+    // Paused input resumes once the backlog drains to the low watermark
+    if (conn->paused) {
+        if (out_pending(conn) > out_low) return true;
+        conn->paused = false;
+    }
+
+    while (1) {
+        size_t avail;
+        char *space = frame_recv_space(&conn->frame, &avail);
+        ssize_t recv_size = recv(conn->client_data.client_sockfd, space, avail, 0);
+        if (recv_size == 0) return false;
+        if (recv_size == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+            if (errno == EINTR) continue;
+            return false;
+        }
+
+        // Complete packets are appended, then their replay is queued and
+        // sent as far as the socket takes it
+        struct replay_t replay;
+        if (frame_received(&conn->frame, recv_size, &conn->session, &replay)) {
+            conn->out[(conn->out_head + conn->out_count) % out_queue_len] = replay;
+            conn->out_count++;
+            if (replay_conn(conn) == -1 || !out_backpressure(conn)) {
+                return false;
+            }
+            if (conn->paused) return true;
+        }
+
+        // Watch the feed once subscribed, its wakefd shares the connection's events
+        if (conn->session.sub != NULL && !conn->sub_watched) {
+            struct epoll_event ev;
+            ev.events = EPOLLIN | EPOLLET;
+            ev.data.ptr = conn;
+            if (epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, conn->session.sub->wakefd, &ev) == -1) {
+                return false;
+            }
+            conn->sub_watched = true;
+            if (subscriber_flush(conn->client_data.client_sockfd, conn->session.sub) == -1) {
+                return false;
+            }
+        }
+    }
+}
+
+void *event_loop(void *arg)
+{
+    struct event_loop_t *loop = (struct event_loop_t *)arg;
+    struct epoll_event events[max_events];
+
+    if (pin_cpus) {
+        pin_thread(loop - loops);
+    }
+
+    while (!signal_exit) {
+        int nfds = epoll_wait(loop->epollfd, events, max_events, -1);
+        if (nfds == -1) {
+            if (errno == EINTR) continue;
+            async_log(LOG_ERR, "ERROR: epoll_wait failed");
+            thread_fatal();
+        }
+        for (int i = 0; i < nfds; i++) {
+            struct conn_t *conn = events[i].data.ptr;
+            // NULL marks the shutdown eventfd
+            if (conn == NULL) continue;
+            if (!service_conn(loop, conn) || (events[i].events & (EPOLLERR | EPOLLHUP))) {
+                close_conn(loop, conn);
+                // A subscriber can have a second event in this batch, from its wakefd
+                for (int j = i + 1; j < nfds; j++) {
+                    if (events[j].data.ptr == conn) events[j].data.ptr = NULL;
+                }
+            }
+        }
+    }
+
+    while (!LIST_EMPTY(&loop->conn_list)) {
+        close_conn(loop, LIST_FIRST(&loop->conn_list));
+    }
+    close(loop->epollfd);
+    return NULL;
+}
+
+// Queue data for the appender and wait until it is in the file, so a
+// replay started afterwards includes it. Safe to call from any thread.
+// Returns 0 on success, -1 if the write failed.
+int append_data(const char *data, size_t len)
+{
+    struct append_req_t req = { .data = data, .len = len, .result = 0 };
+    sem_init(&req.done, 0, 0);
+
+    struct append_req_t *old = __atomic_load_n(&append_head, __ATOMIC_RELAXED);
+    do {
+        req.next = old;
+    } while (!__atomic_compare_exchange_n(&append_head, &old, &req, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    // Only the push onto an empty stack needs to wake the appender
+    if (old == NULL) {
+        sem_post(&append_wake);
+    }
+
+    while (sem_wait(&req.done) == -1 && errno == EINTR);
+    sem_destroy(&req.done);
+    return req.result;
+}
+
+void segment_path(unsigned seq, char *path, size_t size)
+{
+    if (segment_size > 0) {
+        snprintf(path, size, "%s.%06u", aesddata_file, seq);
+    } else {
+        snprintf(path, size, "%s", aesddata_file);
+    }
+}
+
+// Open segment seq starting at logical offset base and make it the one the
+// appender writes to. Anything already in the single file counts as
+// published; segments always start empty.
+// Returns 0 on success, -1 if the file could not be opened.
+int segment_open(unsigned seq, off_t base)
+{
+    char path[PATH_MAX];
+    segment_path(seq, path, sizeof(path));
+
+    struct segment_t *seg = calloc(1, sizeof(struct segment_t));
+    if (seg == NULL) {
+        async_log(LOG_ERR, "ERROR: Failed to malloc");
+        return -1;
+    }
+    int flags = O_CREAT | O_RDWR | O_APPEND | (segment_size > 0 ? O_TRUNC : 0);
+    seg->fd = open(path, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (seg->fd == -1) {
+        async_log(LOG_ERR, "ERROR: Failed to create file - %s", path);
+        free(seg);
+        return -1;
+    }
+    seg->len = lseek(seg->fd, 0, SEEK_END);
+    if (seg->len == -1) {
+        async_log(LOG_ERR, "ERROR: Failed to seek file - %s", path);
+        close(seg->fd);
+        free(seg);
+        return -1;
+    }
+    seg->seq = seq;
+    seg->base = base;
+    seg->refs = 1;
+
+    prof_mutex_lock(&segment_mutex);
+    TAILQ_INSERT_TAIL(&segments, seg, entries);
+    prof_mutex_unlock(&segment_mutex);
+    datafd = seg->fd;
+    __atomic_store_n(&data_end, base + seg->len, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Drop a reference, the last one closes the file
+void segment_put(struct segment_t *seg)
+{
+    prof_mutex_lock(&segment_mutex);
+    bool last = --seg->refs == 0;
+    prof_mutex_unlock(&segment_mutex);
+    if (last) {
+        close(seg->fd);
+        free(seg);
+    }
+}
+
+// Take a reference on the first segment holding data at or after offset.
+// Returns NULL when there is none.
+struct segment_t *segment_get(off_t offset)
+{
+    struct segment_t *seg;
+    prof_mutex_lock(&segment_mutex);
+    TAILQ_FOREACH(seg, &segments, entries) {
+        if (seg->base + __atomic_load_n(&seg->len, __ATOMIC_ACQUIRE) > offset) {
+            seg->refs++;
+            break;
+        }
+    }
+    prof_mutex_unlock(&segment_mutex);
+    return seg;
+}
+
+// Take a reference on the segment the appender is writing
+struct segment_t *segment_current(void)
+{
+    prof_mutex_lock(&segment_mutex);
+    struct segment_t *seg = TAILQ_LAST(&segments, segment_list_t);
+    seg->refs++;
+    prof_mutex_unlock(&segment_mutex);
+    return seg;
+}
+
+// Appender only: start a new segment once the current one is full, then
+// enforce the retention cap. Readers still streaming a dropped segment
+// keep it open through their reference.
+static void segment_rotate(void)
+{
+    struct segment_t *cur = TAILQ_LAST(&segments, segment_list_t);
+    if (segment_size == 0 || cur->len < segment_size) {
+        return;
+    }
+    if (durability != DURABILITY_NONE && fdatasync(cur->fd) == -1) {
+        async_log(LOG_ERR, "ERROR: Failed to sync file");
+    }
+    if (segment_open(cur->seq + 1, cur->base + cur->len) == -1) {
+        // Keep appending to the full segment rather than losing data
+        return;
+    }
+
+    while (1) {
+        prof_mutex_lock(&segment_mutex);
+        struct segment_t *oldest = TAILQ_FIRST(&segments);
+        off_t retained = data_end - oldest->base;
+        bool drop = oldest != TAILQ_LAST(&segments, segment_list_t) &&
+                    ((retain_bytes > 0 && retained - oldest->len >= retain_bytes) ||
+                     (retain_records > 0 && retained_records - oldest->records >= retain_records));
+        if (drop) {
+            TAILQ_REMOVE(&segments, oldest, entries);
+            retained_records -= oldest->records;
+        }
+        prof_mutex_unlock(&segment_mutex);
+        if (!drop) break;
+
+        char path[PATH_MAX];
+        segment_path(oldest->seq, path, sizeof(path));
+        if (archive_dir != NULL) {
+            char archived[PATH_MAX];
+            const char *name = strrchr(path, '/');
+            snprintf(archived, sizeof(archived), "%s%s", archive_dir, name != NULL ? name : path);
+            if (rename(path, archived) == -1) {
+                async_log(LOG_WARNING, "Failed to archive %s, removing it", path);
+                unlink(path);
+            }
+        } else {
+            unlink(path);
+        }
+        segment_put(oldest);
+
+        prof_mutex_lock(&segment_mutex);
+        off_t base = TAILQ_FIRST(&segments)->base;
+        prof_mutex_unlock(&segment_mutex);
+        prof_mutex_lock(&record_index_mutex);
+        record_index_trim(&record_index, base);
+        time_index_trim(&time_index, base);
+        prof_mutex_unlock(&record_index_mutex);
+    }
+}
+
+// Parse a timestamp record, as written by write_timestamp(), into its time.
+// Returns 0 on success, -1 if the record is not a timestamp.
+static int parse_timestamp(const char *record, size_t len, time_t *when)
+{
+    char line[128];
+    if (len <= strlen(timestamp_prefix) || len >= sizeof(line) ||
+        memcmp(record, timestamp_prefix, strlen(timestamp_prefix)) != 0) {
+        return -1;
+    }
+    memcpy(line, record, len);
+    line[len] = '\0';
+
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    char *end = strptime(line + strlen(timestamp_prefix), timestamp_format, &tm);
+    if (end == NULL || *end != '\n') {
+        return -1;
+    }
+    *when = timegm(&tm) - tm.tm_gmtoff;
+    return 0;
+}
+
+// Index the records ending in data[0..len), which sits at logical offset
+// pos. A record is a newline terminated packet, one append may carry
+// several; the timestamp records among them are time markers.
+// Appender (and startup) only, with record_index_mutex held.
+// Returns the number of records found.
+static size_t index_records(const char *data, size_t len, off_t pos)
+{
+    size_t records = 0;
+    const char *p = data, *end = data + len;
+
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        p++;
+        off_t next = pos + (p - data);
+        time_t when;
+        // Only a record that starts in this append can be a whole timestamp
+        if (record_start >= pos &&
+            parse_timestamp(data + (record_start - pos), next - record_start, &when) == 0 &&
+            time_index_push(&time_index, when, record_start) == -1) {
+            async_log(LOG_ERR, "ERROR: Failed to malloc");
+            append_fail();
+            break;
+        }
+        if (record_index_push(&record_index, record_start, next) == -1) {
+            async_log(LOG_ERR, "ERROR: Failed to malloc");
+            append_fail();
+            break;
+        }
+        record_start = next;
+        records++;
+    }
+    // Retention trims along with the data, this bounds the index without it
+    record_index_cap(&record_index, record_index_max);
+    return records;
+}
+
+// Read len bytes of the data at logical offset off, across segments.
+// Returns 0 on success, -1 if part of it is gone or can't be read.
+int read_data(char *buf, size_t len, off_t off)
+{
+    while (len > 0) {
+        struct segment_t *seg = segment_get(off);
+        if (seg == NULL) return -1;
+        if (off < seg->base) {
+            segment_put(seg);
+            return -1;
+        }
+        off_t avail = seg->base + __atomic_load_n(&seg->len, __ATOMIC_ACQUIRE) - off;
+        size_t count = (off_t)len < avail ? len : (size_t)avail;
+        ssize_t got = pread(seg->fd, buf, count, off - seg->base);
+        segment_put(seg);
+        if (got == -1 && errno == EINTR) continue;
+        if (got <= 0) return -1;
+        buf += got;
+        off += got;
+        len -= got;
+    }
+    return 0;
+}
+
+// Index what the data file already held at startup
+// Returns 0 on success, -1 if the file could not be read.
+int index_file(void)
+{
+    char buf[64 * 1024];
+    off_t pos = 0;
+
+    while (pos < data_end) {
+        size_t count = data_end - pos < (off_t)sizeof(buf) ? (size_t)(data_end - pos) : sizeof(buf);
+        ssize_t got = pread(datafd, buf, count, pos);
+        if (got == -1 && errno == EINTR) continue;
+        if (got <= 0) {
+            async_log(LOG_ERR, "ERROR: Failed to read file - %s", aesddata_file);
+            return -1;
+        }
+        TAILQ_FIRST(&segments)->records += index_records(buf, got, pos);
+        pos += got;
+    }
+    retained_records = TAILQ_FIRST(&segments)->records;
+    return 0;
+}
+
+// Make sure data_view covers [0, end). Appender (and startup) only.
+// Returns 0 on success, -1 if the file could not be mapped.
+int grow_view(off_t end)
+{
+    struct data_view_t *view = data_view;
+    if (view != NULL && (off_t)view->len >= end) {
+        return 0;
+    }
+
+    size_t len = view != NULL ? view->len : view_min_len;
+    while ((off_t)len < end) {
+        len *= 2;
+    }
+    // Pages past EOF are mapped too, they fill in as the file grows
+    void *base = mmap(NULL, len, PROT_READ, MAP_SHARED, datafd, 0);
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+    struct data_view_t *grown = malloc(sizeof(struct data_view_t));
+    if (grown == NULL) {
+        munmap(base, len);
+        return -1;
+    }
+    grown->base = base;
+    grown->len = len;
+    grown->prev = view;
+    __atomic_store_n(&data_view, grown, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// A fatal error on the appender. It can't run cleanup(), which joins the
+// producers waiting on it, so from here on it fails every request, and
+// the main loop is woken to clean up.
+static void append_fail(void)
+{
+    append_failed = true;
+    request_exit(EXIT_FAILURE);
+}
+
+// Write a batch of requests, in arrival order, with as few writev calls as
+// possible and post each producer when done.
+static void append_batch(struct append_req_t *batch)
+{
+    struct iovec iov[IOV_MAX];
+    struct append_req_t *req = batch;
+
+    while (req != NULL) {
+        struct append_req_t *first = req;
+        int iovcnt = 0;
+        for (; req != NULL && iovcnt < IOV_MAX; req = req->next) {
+            iov[iovcnt].iov_base = (void *)req->data;
+            iov[iovcnt].iov_len = req->len;
+            iovcnt++;
+        }
+
+        int result = append_failed ? -1 : 0;
+        size_t total = 0;
+        for (int i = 0; i < iovcnt; i++) {
+            total += iov[i].iov_len;
+        }
+        struct iovec *pos = iov;
+        while (result == 0 && iovcnt > 0) {
+            ssize_t written = writev(datafd, pos, iovcnt);
+            if (written == -1) {
+                if (errno == EINTR) continue;
+                result = -1;
+                break;
+            }
+            // Skip what went out, resume a partial write mid-iovec
+            while (iovcnt > 0 && (size_t)written >= pos->iov_len) {
+                written -= pos->iov_len;
+                pos++;
+                iovcnt--;
+            }
+            if (iovcnt > 0) {
+                pos->iov_base = (char *)pos->iov_base + written;
+                pos->iov_len -= written;
+            }
+        }
+
+        // Group commit: everybody in the batch shares this fdatasync
+        if (result == 0 && durability == DURABILITY_GROUP && fdatasync(datafd) == -1) {
+            async_log(LOG_ERR, "ERROR: Failed to sync file");
+            result = -1;
+        }
+        if (result == 0 && durability == DURABILITY_PERIODIC) {
+            __atomic_store_n(&data_dirty, true, __ATOMIC_RELEASE);
+        }
+
+        if (result == 0) {
+            struct segment_t *cur = TAILQ_LAST(&segments, segment_list_t);
+            off_t pos = data_end;
+            prof_mutex_lock(&record_index_mutex);
+            for (struct append_req_t *r = first; r != req; r = r->next) {
+                size_t records = index_records(r->data, r->len, pos);
+                cur->records += records;
+                retained_records += records;
+                pos += r->len;
+            }
+            prof_mutex_unlock(&record_index_mutex);
+            __atomic_store_n(&cur->len, cur->len + total, __ATOMIC_RELEASE);
+        }
+
+        // Publish the new end before the producers start their replays,
+        // after the view covers it. A failed mapping only costs the readers
+        // their fast path, they fall back to sendfile.
+        if (result == 0 && mmap_mode && grow_view(data_end + total) == -1) {
+            async_log(LOG_WARNING, "Failed to grow the data file mapping");
+        }
+        if (result == 0) {
+            __atomic_store_n(&data_end, data_end + total, __ATOMIC_RELEASE);
+            if (__atomic_load_n(&subscriber_count, __ATOMIC_ACQUIRE) > 0) {
+                publish(first, req, total);
+            }
+            if (append_failed) result = -1;
+        }
+
+        // req->next must be read before posting, the request is on the producer's stack
+        while (first != req) {
+            struct append_req_t *next = first->next;
+            first->result = result;
+            sem_post(&first->done);
+            first = next;
+        }
+
+        // Segments end on batch, and so packet, boundaries
+        if (!append_failed) segment_rotate();
+    }
+}
+
+void *appender(void *arg) {
+    (void)arg;
+
+    while (!__atomic_load_n(&append_stop, __ATOMIC_ACQUIRE)) {
+        while (sem_wait(&append_wake) == -1 && errno == EINTR);
+
+        struct append_req_t *stack;
+        while ((stack = __atomic_exchange_n(&append_head, NULL, __ATOMIC_ACQUIRE)) != NULL) {
+            // Reverse into arrival order
+            struct append_req_t *batch = NULL;
+            while (stack != NULL) {
+                struct append_req_t *next = stack->next;
+                stack->next = batch;
+                batch = stack;
+                stack = next;
+            }
+            append_batch(batch);
+        }
+    }
+
+    return NULL;
+}
+
+// Periodic durability: sync on an absolute monotonic schedule so the
+// interval does not drift, and skip the sync when nothing was appended.
+void *syncer(void *arg) {
+    struct timespec next;
+
+    (void)arg;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while (!signal_exit) {
+        next.tv_sec += sync_interval_ms / 1000;
+        next.tv_nsec += (long)(sync_interval_ms % 1000) * 1000000;
+        if (next.tv_nsec >= 1000000000) {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+
+        if (__atomic_exchange_n(&data_dirty, false, __ATOMIC_ACQ_REL)) {
+            // A reference, the appender may rotate to a new segment meanwhile
+            struct segment_t *seg = segment_current();
+            if (fdatasync(seg->fd) == -1) {
+                async_log(LOG_ERR, "ERROR: Failed to sync file");
+            }
+            segment_put(seg);
+        }
+    }
+
+    return NULL;
+}
+
+// Format the record for time now into timestamp_cache. The full strftime
+// only runs when the minute changes, localtime_r being the costly part.
+static void format_timestamp(time_t now)
+{
+    struct timestamp_cache_t *cache = &timestamp_cache;
+
+    if (now / 60 != cache->minute) {
+        struct tm tm;
+        localtime_r(&now, &tm);
+        cache->sec_pos = strftime(cache->text, sizeof(cache->text), timestamp_prefix timestamp_format_minute, &tm);
+        size_t zone = strftime(cache->text + cache->sec_pos + 2, sizeof(cache->text) - cache->sec_pos - 2,
+                               timestamp_format_zone "\n", &tm);
+        cache->len = cache->sec_pos + 2 + zone;
+        // A zone offset in seconds would make the minute boundary local, not shared with UTC
+        cache->minute = tm.tm_gmtoff % 60 == 0 ? now / 60 : -1;
+    }
+    int sec = now % 60;
+    cache->text[cache->sec_pos] = '0' + sec / 10;
+    cache->text[cache->sec_pos + 1] = '0' + sec % 10;
+}
+
+static void write_timestamp(void)
+{
+    format_timestamp(time(NULL));
+
+    // Append timestamp to /var/tmp/aesdsocketdata, like any packet
+    if (append_data(timestamp_cache.text, timestamp_cache.len) == -1) {
+        async_log(LOG_ERR, "ERROR: Failed to write timestamp to file");
+    }
+}
+
+// Arm the timestamp for the next multiple of the interval on the wall
+// clock, at least half an interval away so a tick that lands just before
+// a boundary doesn't write it twice. Computed afresh each time, so the
+// cadence never drifts and follows clock steps. Called under timers_mutex.
+static void timestamp_arm(uint64_t now)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    int64_t interval_ms = (int64_t)timestamp_interval_s * 1000;
+    int64_t until_ms = interval_ms - ((int64_t)(ts.tv_sec % timestamp_interval_s) * 1000 + ts.tv_nsec / 1000000);
+    if (until_ms < interval_ms / 2) {
+        until_ms += interval_ms;
+    }
+    timer_wheel_add(&timers, &timestamp_timer, now + (until_ms + timer_tick_ms - 1) / timer_tick_ms);
+}
+
+// Runs under timers_mutex, the append is left to the ticker
+static void timestamp_expire(struct wheel_timer_t *timer, uint64_t now)
+{
+    (void)timer;
+    timestamp_due = true;
+    timestamp_arm(now);
+}
+
+// Timer thread: a periodic timerfd ticks the wheel. If the thread falls
+// behind, the expiration count catches the wheel up instead of letting it
+// drift. Expiry only flags or shuts down sockets under the lock; the
+// timestamp is appended once it is released.
+void *ticker(void *arg) {
+    (void)arg;
+
+    int tickfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    struct itimerspec tick = {
+        .it_interval = { .tv_sec = timer_tick_ms / 1000, .tv_nsec = (long)(timer_tick_ms % 1000) * 1000000 },
+        .it_value = { .tv_sec = timer_tick_ms / 1000, .tv_nsec = (long)(timer_tick_ms % 1000) * 1000000 },
+    };
+    if (tickfd == -1 || timerfd_settime(tickfd, 0, &tick, NULL) == -1) {
+        async_log(LOG_ERR, "ERROR: Failed to create timer");
+        thread_fatal();
+    }
+
+    write_timestamp();
+    wheel_timer_init(&timestamp_timer, timestamp_expire, NULL);
+    prof_mutex_lock(&timers_mutex);
+    timestamp_arm(timer_ticks);
+    prof_mutex_unlock(&timers_mutex);
+
+    while (!signal_exit) {
+        uint64_t expirations;
+        if (read(tickfd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+            if (errno == EINTR) continue;
+            async_log(LOG_ERR, "ERROR: Failed to read timer");
+            thread_fatal();
+        }
+
+        prof_mutex_lock(&timers_mutex);
+        uint64_t now = __atomic_add_fetch(&timer_ticks, expirations, __ATOMIC_RELAXED);
+        timer_wheel_advance(&timers, now);
+        bool due = timestamp_due;
+        timestamp_due = false;
+        prof_mutex_unlock(&timers_mutex);
+
+        if (due) {
+            write_timestamp();
+        }
     }
 
+    close(tickfd);
     return NULL;
 }
 
@@ -0,0 +1,355 @@
+#define _GNU_SOURCE
+#include "async_log.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#define ring_len 256                // messages per thread, a power of two
+#define msg_max 240
+#define signal_slots 16
+#define drain_interval_ms 100
+
+struct log_msg_t {
+    struct timespec when;
+    int priority;
+    int len;
+    char text[msg_max];
+};
+
+// One thread's messages, the owner writes at head and the drain thread
+// reads at tail. The drop counters are only reset by the drain thread.
+struct log_ring_t {
+    uint64_t head;
+    uint64_t tail;
+    uint64_t full;                  // dropped on a full ring
+    uint64_t limited;               // dropped over the rate
+    uint64_t allowed_ns;            // when the next message is due under the rate, owner only
+    bool owned;                     // cleared when the owner exits, the ring is then reused
+    struct log_ring_t *next;
+    struct log_msg_t msgs[ring_len];
+};
+
+// Slots for signal handlers, taken with a compare and swap. The sequence
+// number keeps them in order, there are too few to need a ring.
+enum { SLOT_FREE, SLOT_BUSY, SLOT_READY };
+
+struct signal_slot_t {
+    int state;
+    int priority;
+    int len;
+    uint64_t seq;
+    struct timespec when;
+    char text[msg_max];
+};
+
+static const char *level_names[] = { "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug" };
+
+// Every ring, pushed on first use and never freed
+static struct log_ring_t *all_rings = NULL;
+static __thread struct log_ring_t *local_ring = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static struct signal_slot_t signal_slot[signal_slots];
+static uint64_t signal_seq = 0;
+
+static bool running = false;
+static bool stopping = false;
+static int wakefd = -1;
+static FILE *log_file = NULL;
+static int min_level = LOG_DEBUG;
+static uint64_t interval_ns = 0;    // between messages at the rate, 0 for no limit
+static pthread_t drain_thread;
+
+// Write one message to the sink, syslog or the file
+static void output(int priority, const struct timespec *when, const char *text, int len)
+{
+    if (log_file == NULL) {
+        syslog(priority, "%.*s", len, text);
+        return;
+    }
+    struct tm tm;
+    char stamp[32];
+    localtime_r(&when->tv_sec, &tm);
+    strftime(stamp, sizeof(stamp), "%b %d %H:%M:%S", &tm);
+    fprintf(log_file, "%s.%06ld %s[%d] %s: %.*s\n", stamp, when->tv_nsec / 1000, program_invocation_short_name,
+            getpid(), level_names[LOG_PRI(priority)], len, text);
+}
+
+// Synchronous path, before the start and after the stop
+static void output_now(int priority, const char *fmt, va_list ap)
+{
+    if (log_file == NULL) {
+        vsyslog(priority, fmt, ap);
+        return;
+    }
+    char *text;
+    struct timespec when;
+    clock_gettime(CLOCK_REALTIME, &when);
+    int n = vasprintf(&text, fmt, ap);
+    if (n >= 0) {
+        output(priority, &when, text, n);
+        free(text);
+    }
+    fflush(log_file);
+}
+
+static void wake_drain(void)
+{
+    uint64_t one = 1;
+    // Nothing to do if it fails, the drain thread wakes up on its own
+    ssize_t rc = write(wakefd, &one, sizeof(one));
+    (void)rc;
+}
+
+static void ring_release(void *arg)
+{
+    struct log_ring_t *ring = arg;
+    __atomic_store_n(&ring->owned, false, __ATOMIC_RELEASE);
+}
+
+static void ring_key_init(void)
+{
+    pthread_key_create(&ring_key, ring_release);
+}
+
+// The calling thread's ring, one left by a thread that exited or a new
+// one. NULL if it could not be allocated.
+static struct log_ring_t *ring_local(void)
+{
+    if (local_ring != NULL) return local_ring;
+
+    pthread_once(&ring_key_once, ring_key_init);
+    struct log_ring_t *ring;
+    for (ring = __atomic_load_n(&all_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        bool owned = false;
+        if (!__atomic_load_n(&ring->owned, __ATOMIC_RELAXED) &&
+            __atomic_compare_exchange_n(&ring->owned, &owned, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (ring == NULL) {
+        if ((ring = calloc(1, sizeof(struct log_ring_t))) == NULL) return NULL;
+        ring->owned = true;
+        struct log_ring_t *head = __atomic_load_n(&all_rings, __ATOMIC_RELAXED);
+        do {
+            ring->next = head;
+        } while (!__atomic_compare_exchange_n(&all_rings, &head, ring, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    pthread_setspecific(ring_key, ring);
+    local_ring = ring;
+    return ring;
+}
+
+// Rate limit per thread, as a virtual schedule: every message moves the
+// time the next one is due by the interval, and up to a second's worth
+// may be ahead of the clock
+static bool rate_allows(struct log_ring_t *ring)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    if (ring->allowed_ns < now) ring->allowed_ns = now;
+    if (ring->allowed_ns - now >= 1000000000) return false;
+    ring->allowed_ns += interval_ns;
+    return true;
+}
+
+void async_log(int priority, const char *fmt, ...)
+{
+    if (LOG_PRI(priority) > min_level) return;
+
+    va_list ap;
+    va_start(ap, fmt);
+    struct log_ring_t *ring;
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE) || (ring = ring_local()) == NULL) {
+        output_now(priority, fmt, ap);
+        va_end(ap);
+        return;
+    }
+
+    if (interval_ns > 0 && !rate_allows(ring)) {
+        __atomic_fetch_add(&ring->limited, 1, __ATOMIC_RELAXED);
+        va_end(ap);
+        return;
+    }
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail == ring_len) {
+        __atomic_fetch_add(&ring->full, 1, __ATOMIC_RELAXED);
+        va_end(ap);
+        return;
+    }
+    struct log_msg_t *msg = &ring->msgs[head & (ring_len - 1)];
+    va_list copy;
+    va_copy(copy, ap);
+    int n = vsnprintf(msg->text, msg_max, fmt, ap);
+    va_end(ap);
+    if (n >= msg_max) {
+        // Too long for a slot, like the stats lines, and rare: written at once
+        output_now(priority, fmt, copy);
+        va_end(copy);
+        return;
+    }
+    va_end(copy);
+    clock_gettime(CLOCK_REALTIME, &msg->when);
+    msg->priority = priority;
+    msg->len = n < 0 ? 0 : n;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    // The drain thread comes by every drain_interval_ms, a burst calls it early
+    if (head + 1 - tail == ring_len / 2) {
+        wake_drain();
+    }
+}
+
+void async_log_signal(int priority, const char *msg)
+{
+    if (LOG_PRI(priority) > min_level || !__atomic_load_n(&running, __ATOMIC_ACQUIRE)) return;
+
+    int saved_errno = errno;
+    for (int i = 0; i < signal_slots; i++) {
+        struct signal_slot_t *slot = &signal_slot[i];
+        int expected = SLOT_FREE;
+        if (!__atomic_compare_exchange_n(&slot->state, &expected, SLOT_BUSY, false,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        int len = 0;
+        while (msg[len] != '\0' && len < msg_max) {
+            slot->text[len] = msg[len];
+            len++;
+        }
+        slot->len = len;
+        slot->priority = priority;
+        clock_gettime(CLOCK_REALTIME, &slot->when);
+        slot->seq = __atomic_fetch_add(&signal_seq, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->state, SLOT_READY, __ATOMIC_RELEASE);
+        wake_drain();
+        break;
+    }
+    errno = saved_errno;
+}
+
+// Output the signal slots, oldest first
+static void drain_signals(void)
+{
+    while (1) {
+        struct signal_slot_t *oldest = NULL;
+        for (int i = 0; i < signal_slots; i++) {
+            struct signal_slot_t *slot = &signal_slot[i];
+            if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) == SLOT_READY &&
+                (oldest == NULL || slot->seq < oldest->seq)) {
+                oldest = slot;
+            }
+        }
+        if (oldest == NULL) return;
+        output(oldest->priority, &oldest->when, oldest->text, oldest->len);
+        __atomic_store_n(&oldest->state, SLOT_FREE, __ATOMIC_RELEASE);
+    }
+}
+
+// Output what every ring holds, then a line for the messages dropped since the last pass
+static void drain_rings(void)
+{
+    uint64_t full = 0, limited = 0;
+
+    for (struct log_ring_t *ring = __atomic_load_n(&all_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (uint64_t tail = ring->tail; tail != head; tail++) {
+            struct log_msg_t *msg = &ring->msgs[tail & (ring_len - 1)];
+            output(msg->priority, &msg->when, msg->text, msg->len);
+            // Freed one at a time, so the owner can refill the ring meanwhile
+            __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+        }
+        full += __atomic_exchange_n(&ring->full, 0, __ATOMIC_RELAXED);
+        limited += __atomic_exchange_n(&ring->limited, 0, __ATOMIC_RELAXED);
+    }
+    if (full > 0 || limited > 0) {
+        char text[msg_max];
+        struct timespec when;
+        clock_gettime(CLOCK_REALTIME, &when);
+        int n = snprintf(text, sizeof(text), "Dropped %llu log messages, %llu on a full ring and %llu over the rate",
+                         (unsigned long long)(full + limited), (unsigned long long)full, (unsigned long long)limited);
+        output(LOG_WARNING, &when, text, n < msg_max ? n : msg_max - 1);
+    }
+    if (log_file != NULL) fflush(log_file);
+}
+
+static void *drainer(void *arg)
+{
+    (void)arg;
+    // Signals are for the main thread
+    sigset_t set;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    struct pollfd pfd = { .fd = wakefd, .events = POLLIN };
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        if (poll(&pfd, 1, drain_interval_ms) > 0) {
+            uint64_t count;
+            ssize_t rc = read(wakefd, &count, sizeof(count));
+            (void)rc;
+        }
+        drain_signals();
+        drain_rings();
+    }
+    drain_signals();
+    drain_rings();
+    return NULL;
+}
+
+int async_log_start(const char *path, int level, unsigned rate)
+{
+    if (path != NULL && (log_file = fopen(path, "ae")) == NULL) {
+        return -1;
+    }
+    min_level = level;
+    interval_ns = rate > 0 ? 1000000000ull / rate : 0;
+    wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wakefd == -1) {
+        return -1;
+    }
+    __atomic_store_n(&running, true, __ATOMIC_RELEASE);
+    if (pthread_create(&drain_thread, NULL, drainer, NULL) != 0) {
+        __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+        return -1;
+    }
+    // Whatever way the process exits, what is queued is not lost
+    atexit(async_log_stop);
+    return 0;
+}
+
+void async_log_stop(void)
+{
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) return;
+
+    // Messages from here on are written synchronously
+    __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+    wake_drain();
+    pthread_join(drain_thread, NULL);
+}
+
+int async_log_level(const char *name)
+{
+    if (name[0] >= '0' && name[0] <= '7' && name[1] == '\0') {
+        return name[0] - '0';
+    }
+    for (int level = 0; level < (int)(sizeof(level_names) / sizeof(level_names[0])); level++) {
+        if (strcasecmp(name, level_names[level]) == 0) return level;
+    }
+    return -1;
+}
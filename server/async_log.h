@@ -0,0 +1,53 @@
+#ifndef ASYNC_LOG_H
+#define ASYNC_LOG_H
+
+/**
+ * Logging off the hot path. Each thread formats its messages into a ring
+ * of its own, without a lock or a system call, and a background thread
+ * drains the rings into syslog or a file. A message that finds its
+ * thread's ring full, or the thread over its rate, is dropped and
+ * counted, and the drops are reported.
+ *
+ * Messages are in order per thread. In the file each one carries the
+ * time it was logged, so a merged order can be recovered.
+ */
+
+/**
+ * Start the drain thread. Messages go to syslog, or are appended to
+ * @param path if not NULL. Those less severe than @param level (a LOG_*
+ * priority) are dropped at the call. Each thread may log @param rate
+ * messages per second with bursts of as many, 0 for no limit.
+ * Before it is started, and after async_log_stop(), messages are written
+ * synchronously.
+ * @return 0 on success, -1 if the file or the thread could not be set up.
+ */
+int async_log_start(const char *path, int level, unsigned rate);
+
+/**
+ * Queue a message, like syslog(). Safe to call from any thread but not
+ * from a signal handler. A message too long for a ring slot is written
+ * synchronously instead of being cut.
+ */
+void async_log(int priority, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * Queue the fixed message @param msg from a signal handler. Async-signal
+ * safe: no formatting, no allocation and no lock, just a free slot taken
+ * with an atomic and a write() to wake the drain thread.
+ * Dropped if the signal slots are full, or before async_log_start().
+ */
+void async_log_signal(int priority, const char *msg);
+
+/**
+ * Drain everything queued and stop the drain thread, once the threads
+ * that log are stopped. Also registered with atexit() by the start.
+ */
+void async_log_stop(void);
+
+/**
+ * Parse a level given as a LOG_* number or name ("err", "warning",
+ * "info", ...). @return the priority, or -1 if it is not one.
+ */
+int async_log_level(const char *name);
+
+#endif
@@ -0,0 +1,530 @@
+// Microbenchmarks for the hot paths of aesdsocket: framing, the group
+// commit appender under contention, replays from 1 KB up to -R bytes and
+// the timestamp formatting. The server is compiled in with its main renamed,
+// so the static functions are measured as they ship, not copies of them.
+//
+// Each benchmark is calibrated until one repetition takes at least -t ms,
+// warmed up -w times and then repeated -r times. The median is reported
+// with the spread around it, the median absolute deviation in percent, so
+// a regression can be told from noise. Output is CSV, like loadgen.
+#define main aesdsocket_main
+#include "aesdsocket.c"
+#undef main
+
+#include <sched.h>
+
+#define bench_reps_max 101
+#define frame_chunk (16 * 1024)
+#define frame_input (1024 * 1024)
+#define fill_block (1024 * 1024)
+#define fill_line 1024
+#define drain_size (256 * 1024)
+
+struct bench_config_t {
+    int reps;
+    int warmups;
+    uint64_t min_rep_ns;
+    off_t replay_max;
+    const char *filter;
+    bool header;
+};
+
+struct bench_config_t bench = {
+    .reps = 11,
+    .warmups = 2,
+    .min_rep_ns = 50 * 1000000ull,
+    .replay_max = 64 * 1024 * 1024,     // -R raises it, up to 1 GB of replay sizes
+    .filter = NULL,
+    .header = true,
+};
+
+// One benchmark body: run ops operations, return how many were done
+typedef uint64_t (*bench_fn)(void *arg, uint64_t ops);
+
+static uint64_t bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static bool bench_selected(const char *name)
+{
+    return bench.filter == NULL || strstr(name, bench.filter) != NULL;
+}
+
+static double median_of(double *sorted, int n)
+{
+    return n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+}
+
+// Calibrate, warm up and repeat fn, then print one CSV row in ns per op.
+// Throughput is left empty when an op carries no bytes.
+static void bench_run(const char *name, const char *param, size_t bytes_per_op, bench_fn fn, void *arg)
+{
+    if (!bench_selected(name)) return;
+
+    // A first call to take the one-off costs (page faults, lazy allocations)
+    // out of the calibration, then double the ops until one repetition is
+    // long enough to time reliably
+    uint64_t ops = 1;
+    fn(arg, ops);
+    while (1) {
+        uint64_t start = bench_now();
+        fn(arg, ops);
+        if (bench_now() - start >= bench.min_rep_ns || ops >= (1ull << 40)) break;
+        ops *= 2;
+    }
+    for (int i = 0; i < bench.warmups; i++) {
+        fn(arg, ops);
+    }
+
+    double samples[bench_reps_max], deviations[bench_reps_max];
+    uint64_t done = 0;
+    for (int i = 0; i < bench.reps; i++) {
+        uint64_t start = bench_now();
+        done = fn(arg, ops);
+        samples[i] = (double)(bench_now() - start) / done;
+    }
+    qsort(samples, bench.reps, sizeof(double), compare_double);
+    double median = median_of(samples, bench.reps);
+    for (int i = 0; i < bench.reps; i++) {
+        deviations[i] = samples[i] > median ? samples[i] - median : median - samples[i];
+    }
+    qsort(deviations, bench.reps, sizeof(double), compare_double);
+    double mad = median_of(deviations, bench.reps);
+
+    printf("%s,%s,%llu,%d,%.1f,%.1f,%.1f,%.2f,", name, param, (unsigned long long)done, bench.reps,
+           median, samples[0], samples[bench.reps - 1], median > 0 ? 100 * mad / median : 0);
+    if (bytes_per_op > 0) {
+        printf("%.1f\n", bytes_per_op * 1e3 / median);
+    } else {
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+// Framing: what a connection does with each receive before anything is
+// appended, the frame commit with its newline scan, which also counts the
+// packets, and the consume. The memcpy stands in for the copy recv() makes.
+struct frame_bench_t {
+    char *input;
+    size_t pos;
+    struct frame_buf_t frame;
+    size_t packets;
+};
+
+static uint64_t bench_frame(void *arg, uint64_t ops)
+{
+    struct frame_bench_t *b = arg;
+    for (uint64_t i = 0; i < ops; i++) {
+        size_t left = frame_chunk;
+        while (left > 0) {
+            size_t avail;
+            char *space = frame_space(&b->frame, &avail);
+            if (space == NULL) {
+                fprintf(stderr, "Failed to malloc\n");
+                exit(EXIT_FAILURE);
+            }
+            size_t n = avail < left ? avail : left;
+            if (b->pos + n > frame_input) n = frame_input - b->pos;
+            memcpy(space, b->input + b->pos, n);
+            b->pos = (b->pos + n) % frame_input;
+            left -= n;
+
+            size_t complete = frame_commit(&b->frame, n);
+            if (complete > 0) {
+                b->packets += b->frame.packets;
+                frame_consume(&b->frame, complete);
+            }
+        }
+    }
+    return ops;
+}
+
+static void run_frame(void)
+{
+    static const size_t sizes[] = { 16, 128, 1024, 65536 };
+    struct frame_bench_t b;
+
+    b.input = malloc(frame_input);
+    if (b.input == NULL) {
+        fprintf(stderr, "Failed to malloc\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (size_t i = 0; i < frame_input; i++) {
+            b.input[i] = i % sizes[s] == sizes[s] - 1 ? '\n' : 'x';
+        }
+        b.pos = 0;
+        b.packets = 0;
+        if (frame_init(&b.frame, buffer_size) == -1) {
+            fprintf(stderr, "Failed to malloc\n");
+            exit(EXIT_FAILURE);
+        }
+        char param[32];
+        snprintf(param, sizeof(param), "%zu", sizes[s]);
+        bench_run("frame", param, frame_chunk, bench_frame, &b);
+        frame_free(&b.frame);
+    }
+    free(b.input);
+}
+
+// Append: N producers calling append_data() at once, as N connections
+// do, so the cost per packet includes the batching by the appender
+struct append_bench_t {
+    int threads;
+    uint64_t per_thread;
+    pthread_barrier_t start;
+};
+
+static const char append_packet[] = "bench packet, about the size of a short log line from a client\n";
+
+static void *append_producer(void *arg)
+{
+    struct append_bench_t *b = arg;
+    pthread_barrier_wait(&b->start);
+    for (uint64_t i = 0; i < b->per_thread; i++) {
+        if (append_data(append_packet, sizeof(append_packet) - 1) == -1) {
+            fprintf(stderr, "Failed to append\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return NULL;
+}
+
+static uint64_t bench_append(void *arg, uint64_t ops)
+{
+    struct append_bench_t *b = arg;
+    pthread_t threads[64];
+
+    b->per_thread = ops / b->threads > 0 ? ops / b->threads : 1;
+    pthread_barrier_init(&b->start, NULL, b->threads + 1);
+    for (int i = 0; i < b->threads; i++) {
+        if (pthread_create(&threads[i], NULL, append_producer, b) != 0) {
+            fprintf(stderr, "Failed to create thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    // Creating the threads is timed too, little next to a repetition
+    pthread_barrier_wait(&b->start);
+    for (int i = 0; i < b->threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_barrier_destroy(&b->start);
+    return b->per_thread * b->threads;
+}
+
+static void run_append(void)
+{
+    static const int counts[] = { 1, 2, 4, 8, 16, 64 };
+    struct append_bench_t b;
+
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        char param[32];
+        b.threads = counts[i];
+        snprintf(param, sizeof(param), "%d", counts[i]);
+        bench_run("append", param, sizeof(append_packet) - 1, bench_append, &b);
+    }
+}
+
+// Replay: the whole file up to a size sent to a loopback TCP client that
+// only drains, an op being done once the client has read all of it. With
+// sendfile, with send from the mapped view (-m) and with the linked
+// READ_FIXED -> SEND chains of -u.
+struct replay_bench_t {
+    int sockfd;
+    int drainfd;
+    off_t size;
+    uint64_t received;      // by the drain thread
+    bool uring;
+    struct uring_t ring;
+    struct iovec iovs[uring_buf_count];
+};
+
+static void *replay_drain(void *arg)
+{
+    struct replay_bench_t *b = arg;
+    char *buf = malloc(drain_size);
+    ssize_t got;
+
+    if (buf == NULL) {
+        fprintf(stderr, "Failed to malloc\n");
+        exit(EXIT_FAILURE);
+    }
+    while ((got = recv(b->drainfd, buf, drain_size, 0)) > 0) {
+        __atomic_add_fetch(&b->received, got, __ATOMIC_RELEASE);
+    }
+    free(buf);
+    return NULL;
+}
+
+static uint64_t bench_replay(void *arg, uint64_t ops)
+{
+    struct replay_bench_t *b = arg;
+    for (uint64_t i = 0; i < ops; i++) {
+        uint64_t target = __atomic_load_n(&b->received, __ATOMIC_ACQUIRE) + b->size;
+        off_t off = 0;
+        if (b->uring ? !replay_uring(&b->ring, b->iovs, b->sockfd, off, b->size)
+                     : replay_file(b->sockfd, &off, b->size) != 1) {
+            fprintf(stderr, "Failed to replay\n");
+            exit(EXIT_FAILURE);
+        }
+        while (__atomic_load_n(&b->received, __ATOMIC_ACQUIRE) < target) {
+            sched_yield();
+        }
+    }
+    return ops;
+}
+
+// Connected loopback pair: the server side for replay_file, the client to drain
+static void replay_sockets(int *server, int *client)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t addr_len = sizeof(addr);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (listener == -1 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(listener, 1) == -1 || getsockname(listener, (struct sockaddr *)&addr, &addr_len) == -1 ||
+        (*client = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+        connect(*client, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        (*server = accept(listener, NULL, NULL)) == -1) {
+        fprintf(stderr, "Failed to connect over loopback\n");
+        exit(EXIT_FAILURE);
+    }
+    close(listener);
+}
+
+// Grow the data file to size with packets, through the appender. Long
+// ones keep the record index small at 1 GB.
+static void replay_fill(off_t size)
+{
+    char *block = malloc(fill_block);
+    if (block == NULL) {
+        fprintf(stderr, "Failed to malloc\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < fill_block; i++) {
+        block[i] = i % fill_line == fill_line - 1 ? '\n' : 'r';
+    }
+    while (published_end() < size) {
+        off_t missing = size - published_end();
+        if (append_data(block, missing < fill_block ? missing : fill_block) == -1) {
+            fprintf(stderr, "Failed to append\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(block);
+}
+
+// The ring of a -u connection: the socket and the data file as fixed
+// files, uring_buf_count registered buffers.
+// Returns 0 on success, -1 if io_uring can't be used here.
+static int replay_uring_init(struct replay_bench_t *b)
+{
+    int files[2] = { b->sockfd, datafd };
+
+    if (!uring_supported() || uring_init(&b->ring, 3 * uring_buf_count) != 0) {
+        return -1;
+    }
+    char *buffers = malloc(uring_buf_count * uring_buf_size);
+    if (buffers == NULL) {
+        fprintf(stderr, "Failed to malloc\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < uring_buf_count; i++) {
+        b->iovs[i].iov_base = buffers + i * uring_buf_size;
+        b->iovs[i].iov_len = uring_buf_size;
+    }
+    if (uring_register_files(&b->ring, files, 2) != 0 ||
+        uring_register_buffers(&b->ring, b->iovs, uring_buf_count) != 0) {
+        uring_exit(&b->ring);
+        free(buffers);
+        return -1;
+    }
+    return 0;
+}
+
+static void run_replay(void)
+{
+    static const off_t sizes[] = {
+        1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024, 256 * 1024 * 1024, 1024 * 1024 * 1024,
+    };
+    static const char *const names[] = { "replay_sendfile", "replay_mmap", "replay_uring" };
+    struct replay_bench_t b = { .received = 0, .uring = false };
+    pthread_t drain;
+
+    if (!bench_selected(names[0]) && !bench_selected(names[1]) && !bench_selected(names[2])) return;
+    replay_fill(bench.replay_max);
+    replay_sockets(&b.sockfd, &b.drainfd);
+    if (pthread_create(&drain, NULL, replay_drain, &b) != 0) {
+        fprintf(stderr, "Failed to create thread\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int path = 0; path < 3; path++) {
+        if (!bench_selected(names[path])) continue;
+        // The appender is idle by now, so the view can be set up from here
+        if (path == 1 && (grow_view(published_end()) == -1)) {
+            fprintf(stderr, "Failed to map the data file\n");
+            continue;
+        }
+        if (path == 2 && replay_uring_init(&b) == -1) {
+            fprintf(stderr, "io_uring is not available, skipping %s\n", names[path]);
+            continue;
+        }
+        mmap_mode = path == 1;
+        b.uring = path == 2;
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]) && sizes[i] <= bench.replay_max; i++) {
+            char param[32];
+            b.size = sizes[i];
+            snprintf(param, sizeof(param), "%lld", (long long)sizes[i]);
+            bench_run(names[path], param, sizes[i], bench_replay, &b);
+        }
+    }
+    mmap_mode = false;
+    if (b.uring) {
+        uring_exit(&b.ring);
+        free(b.iovs[0].iov_base);
+    }
+    shutdown(b.sockfd, SHUT_RDWR);
+    pthread_join(drain, NULL);
+    close(b.sockfd);
+    close(b.drainfd);
+}
+
+// Timestamps: the cached path within a minute, a new minute every time,
+// and the full localtime_r and strftime the cache saves
+struct timestamp_bench_t {
+    time_t now;
+    time_t step;
+};
+
+static uint64_t bench_timestamp(void *arg, uint64_t ops)
+{
+    struct timestamp_bench_t *b = arg;
+    for (uint64_t i = 0; i < ops; i++) {
+        format_timestamp(b->now);
+        b->now += b->step;
+    }
+    return ops;
+}
+
+static uint64_t bench_strftime(void *arg, uint64_t ops)
+{
+    struct timestamp_bench_t *b = arg;
+    char text[128];
+    for (uint64_t i = 0; i < ops; i++) {
+        struct tm tm;
+        localtime_r(&b->now, &tm);
+        strftime(text, sizeof(text), timestamp_prefix timestamp_format "\n", &tm);
+        b->now += b->step;
+        __asm__ volatile("" : : "r"(text) : "memory");
+    }
+    return ops;
+}
+
+static void run_timestamp(void)
+{
+    struct timestamp_bench_t b = { .now = time(NULL), .step = 1 };
+
+    bench_run("timestamp", "same_minute", 0, bench_timestamp, &b);
+    b.step = 60;
+    bench_run("timestamp", "new_minute", 0, bench_timestamp, &b);
+    b.step = 1;
+    bench_run("timestamp", "strftime", 0, bench_strftime, &b);
+}
+
+// Stop the appender as cleanup() does, once its last batch is written.
+// The replay data runs to replay_max bytes, it must not outlive a run that
+// fails or is interrupted.
+static void bench_exit(void)
+{
+    if (appender_thread != 0) {
+        __atomic_store_n(&append_stop, true, __ATOMIC_RELEASE);
+        sem_post(&append_wake);
+        join_thread(appender_thread, "appender");
+    }
+    unlink(aesddata_file);
+}
+
+static void interrupted(int signo)
+{
+    unlink(aesddata_file);
+    _exit(128 + signo);
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [-r reps] [-w warmups] [-t min_rep_ms] [-R replay_max_bytes] [-b benchmark]"
+            " [-f data_file] [-q]\n", argv0);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    aesddata_file = "/var/tmp/aesdbenchdata";
+    while ((opt = getopt(argc, argv, "r:w:t:R:b:f:q")) != -1) {
+        switch (opt) {
+        case 'r':
+            bench.reps = atoi(optarg);
+            break;
+        case 'w':
+            bench.warmups = atoi(optarg);
+            break;
+        case 't':
+            bench.min_rep_ns = strtoull(optarg, NULL, 10) * 1000000;
+            break;
+        case 'R':
+            bench.replay_max = strtoll(optarg, NULL, 10);
+            break;
+        case 'b':
+            bench.filter = optarg;
+            break;
+        case 'f':
+            aesddata_file = optarg;
+            break;
+        case 'q':
+            bench.header = false;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (bench.reps <= 0 || bench.reps > bench_reps_max || bench.warmups < 0 || bench.replay_max <= 0) {
+        usage(argv[0]);
+    }
+
+    // The data path as main() sets it up, minus the sockets
+    unlink(aesddata_file);
+    atexit(bench_exit);
+    signal(SIGINT, interrupted);
+    signal(SIGTERM, interrupted);
+    if (segment_open(0, 0) == -1) {
+        fprintf(stderr, "Failed to open %s\n", aesddata_file);
+        exit(EXIT_FAILURE);
+    }
+    record_index_init(&record_index, 0);
+    time_index_init(&time_index);
+    sem_init(&append_wake, 0, 0);
+    if (pthread_create(&appender_thread, NULL, appender, NULL) != 0) {
+        fprintf(stderr, "Failed to create appender thread\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (bench.header) {
+        printf("benchmark,param,ops,reps,median_ns,min_ns,max_ns,mad_pct,mb_s\n");
+    }
+    run_frame();
+    run_append();
+    run_replay();
+    run_timestamp();
+    return 0;
+}
@@ -0,0 +1,143 @@
+#include "chunk_cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+int chunk_cache_init(struct chunk_cache_t *cache, size_t chunk_size, size_t capacity,
+                     int (*load)(char *buf, size_t len, off_t off))
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->chunk_size = chunk_size;
+    cache->capacity = capacity;
+    cache->load = load;
+    // About one bucket per chunk that fits
+    cache->bucket_count = capacity / chunk_size + 1;
+    cache->buckets = calloc(cache->bucket_count, sizeof(struct chunk_bucket_t));
+    if (cache->buckets == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < cache->bucket_count; i++) {
+        LIST_INIT(&cache->buckets[i]);
+    }
+    TAILQ_INIT(&cache->idle);
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->loaded, NULL);
+    return 0;
+}
+
+static void chunk_free(struct chunk_t *chunk)
+{
+    free(chunk->data);
+    free(chunk);
+}
+
+void chunk_cache_destroy(struct chunk_cache_t *cache)
+{
+    struct chunk_t *chunk;
+    while ((chunk = TAILQ_FIRST(&cache->idle)) != NULL) {
+        TAILQ_REMOVE(&cache->idle, chunk, idle);
+        chunk_free(chunk);
+    }
+    free(cache->buckets);
+    pthread_mutex_destroy(&cache->lock);
+    pthread_cond_destroy(&cache->loaded);
+    memset(cache, 0, sizeof(*cache));
+}
+
+static struct chunk_bucket_t *bucket_of(struct chunk_cache_t *cache, off_t start)
+{
+    return &cache->buckets[(start / cache->chunk_size) % cache->bucket_count];
+}
+
+// Free idle chunks, oldest first, until the cache fits. Called with the lock held.
+static void evict(struct chunk_cache_t *cache)
+{
+    struct chunk_t *chunk;
+    while (cache->bytes > cache->capacity && (chunk = TAILQ_FIRST(&cache->idle)) != NULL) {
+        TAILQ_REMOVE(&cache->idle, chunk, idle);
+        LIST_REMOVE(chunk, hash);
+        cache->bytes -= chunk->len;
+        chunk_free(chunk);
+    }
+}
+
+// Drop a reference with the lock held
+static void release(struct chunk_cache_t *cache, struct chunk_t *chunk)
+{
+    if (--chunk->refs > 0) return;
+    if (chunk->failed) {
+        // Already out of the hash, nobody can find it again
+        chunk_free(chunk);
+        return;
+    }
+    TAILQ_INSERT_TAIL(&cache->idle, chunk, idle);
+    evict(cache);
+}
+
+const struct chunk_t *chunk_cache_get(struct chunk_cache_t *cache, off_t off, off_t end)
+{
+    off_t start = off - off % cache->chunk_size;
+    size_t len = end - start < (off_t)cache->chunk_size ? (size_t)(end - start) : cache->chunk_size;
+    struct chunk_bucket_t *bucket = bucket_of(cache, start);
+    struct chunk_t *chunk;
+
+    pthread_mutex_lock(&cache->lock);
+    LIST_FOREACH(chunk, bucket, hash) {
+        if (chunk->start == start && chunk->len == len) break;
+    }
+    if (chunk != NULL) {
+        if (chunk->refs++ == 0) {
+            TAILQ_REMOVE(&cache->idle, chunk, idle);
+        }
+        cache->hits++;
+        // Somebody else is reading it, wait instead of reading it again
+        while (!chunk->ready) {
+            pthread_cond_wait(&cache->loaded, &cache->lock);
+        }
+        if (chunk->failed) {
+            release(cache, chunk);
+            chunk = NULL;
+        }
+        pthread_mutex_unlock(&cache->lock);
+        return chunk;
+    }
+
+    chunk = calloc(1, sizeof(struct chunk_t));
+    if (chunk == NULL || (chunk->data = malloc(len)) == NULL) {
+        free(chunk);
+        pthread_mutex_unlock(&cache->lock);
+        return NULL;
+    }
+    chunk->start = start;
+    chunk->len = len;
+    chunk->refs = 1;
+    LIST_INSERT_HEAD(bucket, chunk, hash);
+    cache->bytes += len;
+    cache->misses++;
+    evict(cache);
+    pthread_mutex_unlock(&cache->lock);
+
+    // Load outside the lock, readers of other chunks go on meanwhile
+    int rc = cache->load(chunk->data, len, start);
+
+    pthread_mutex_lock(&cache->lock);
+    chunk->ready = true;
+    if (rc == -1) {
+        chunk->failed = true;
+        LIST_REMOVE(chunk, hash);
+        cache->bytes -= len;
+    }
+    pthread_cond_broadcast(&cache->loaded);
+    if (chunk->failed) {
+        release(cache, chunk);
+        chunk = NULL;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return chunk;
+}
+
+void chunk_cache_put(struct chunk_cache_t *cache, const struct chunk_t *chunk)
+{
+    pthread_mutex_lock(&cache->lock);
+    release(cache, (struct chunk_t *)chunk);
+    pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,75 @@
+#ifndef CHUNK_CACHE_H
+#define CHUNK_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "queue.h"
+
+/**
+ * Immutable, reference counted copy of data[start..start+len). The data
+ * only ever grows at the end, so a chunk is identified by its start and
+ * the append version (the published end) it was read at: a full chunk is
+ * the same at every later version, a tail chunk is superseded by a longer
+ * one without invalidating it for the readers that still hold it.
+ */
+struct chunk_t {
+    off_t start;
+    size_t len;
+    char *data;
+    int refs;
+    bool ready;         // loaded, or failed
+    bool failed;
+    LIST_ENTRY(chunk_t) hash;
+    TAILQ_ENTRY(chunk_t) idle;
+};
+
+LIST_HEAD(chunk_bucket_t, chunk_t);
+
+/**
+ * Chunks shared by concurrent replayers. The first reader of a chunk
+ * loads it, the others wait for it; unreferenced chunks stay cached until
+ * the capacity is exceeded, least recently used first. Thread safe.
+ */
+struct chunk_cache_t {
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;
+    size_t chunk_size;
+    size_t capacity;
+    size_t bytes;
+    struct chunk_bucket_t *buckets;
+    size_t bucket_count;
+    TAILQ_HEAD(, chunk_t) idle;
+    int (*load)(char *buf, size_t len, off_t off);
+    unsigned long hits;
+    unsigned long misses;
+};
+
+/**
+ * Set up a cache of @param capacity bytes in chunks of @param chunk_size,
+ * filled by @param load, which reads len bytes at off and returns 0, or -1
+ * if they can't be read.
+ * @return 0 on success, -1 if the allocation failed.
+ */
+int chunk_cache_init(struct chunk_cache_t *cache, size_t chunk_size, size_t capacity,
+                     int (*load)(char *buf, size_t len, off_t off));
+
+/**
+ * Free the cache, no chunk may be held any more.
+ */
+void chunk_cache_destroy(struct chunk_cache_t *cache);
+
+/**
+ * Take a reference on the chunk holding offset @param off of the data as
+ * of version @param end, loading it on a miss.
+ * @return the chunk, or NULL if it could not be loaded.
+ */
+const struct chunk_t *chunk_cache_get(struct chunk_cache_t *cache, off_t off, off_t end);
+
+/**
+ * Drop a reference taken by chunk_cache_get.
+ */
+void chunk_cache_put(struct chunk_cache_t *cache, const struct chunk_t *chunk);
+
+#endif
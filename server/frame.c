@@ -0,0 +1,133 @@
+#include "frame.h"
+#include "slab.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// Account the newline at data[i]: it completes the open packet, and the
+// next one starts right after it
+static inline void frame_newline(struct frame_buf_t *fb, size_t i)
+{
+    fb->packets++;
+    fb->marked += fb->open_marked;
+    fb->complete = i + 1;
+    fb->open_marked = i + 1 < fb->len && fb->data[i + 1] == frame_mark;
+}
+
+static void scan_generic(struct frame_buf_t *fb, size_t i)
+{
+    const char *p = fb->data + i, *end = fb->data + fb->len;
+
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        frame_newline(fb, p - fb->data);
+        p++;
+    }
+}
+
+#if defined(__SSE2__)
+// Forward 16 bytes at a time, each newline in the mask in order
+static void scan_sse2(struct frame_buf_t *fb, size_t i)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+
+    for (; i + 16 <= fb->len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(fb->data + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, nl));
+        while (mask != 0) {
+            frame_newline(fb, i + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+    scan_generic(fb, i);
+}
+
+__attribute__((target("avx2")))
+static void scan_avx2(struct frame_buf_t *fb, size_t i)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+
+    for (; i + 32 <= fb->len; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(fb->data + i));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, nl));
+        while (mask != 0) {
+            frame_newline(fb, i + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+    scan_sse2(fb, i);
+}
+#endif
+
+static void (*scan)(struct frame_buf_t *fb, size_t i) = scan_generic;
+
+// Pick the scanner once at startup
+__attribute__((constructor))
+static void frame_select_scanner(void)
+{
+#if defined(__SSE2__)
+    __builtin_cpu_init();
+    scan = __builtin_cpu_supports("avx2") ? scan_avx2 : scan_sse2;
+#endif
+}
+
+int frame_init(struct frame_buf_t *fb, size_t initial)
+{
+    memset(fb, 0, sizeof(*fb));
+    fb->data = slab_alloc(initial);
+    if (fb->data == NULL) {
+        return -1;
+    }
+    fb->cap = slab_size(initial);
+    return 0;
+}
+
+void frame_free(struct frame_buf_t *fb)
+{
+    slab_free(fb->data, fb->cap);
+    memset(fb, 0, sizeof(*fb));
+}
+
+char *frame_space(struct frame_buf_t *fb, size_t *avail)
+{
+    if (fb->len == fb->cap) {
+        // Moved to the next size class, the old buffer goes back to its pool
+        size_t cap = slab_size(fb->cap * 2);
+        char *data = slab_alloc(cap);
+        if (data == NULL) {
+            return NULL;
+        }
+        memcpy(data, fb->data, fb->len);
+        slab_free(fb->data, fb->cap);
+        fb->data = data;
+        fb->cap = cap;
+    }
+    *avail = fb->cap - fb->len;
+    return fb->data + fb->len;
+}
+
+size_t frame_commit(struct frame_buf_t *fb, size_t n)
+{
+    // The open packet's first byte may only arrive now
+    if (fb->scanned == fb->complete && n > 0) {
+        fb->open_marked = fb->data[fb->scanned] == frame_mark;
+    }
+    fb->len += n;
+    scan(fb, fb->scanned);
+    fb->scanned = fb->len;
+    return fb->complete;
+}
+
+void frame_consume(struct frame_buf_t *fb, size_t n)
+{
+    if (n < fb->len) {
+        memmove(fb->data, fb->data + n, fb->len - n);
+    }
+    fb->len -= n;
+    fb->scanned = fb->len;
+    fb->complete = fb->complete > n ? fb->complete - n : 0;
+    fb->packets = 0;
+    fb->marked = 0;
+}
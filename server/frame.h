@@ -0,0 +1,68 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * First byte of the packets frame_commit() counts in @marked: the start of
+ * the AESDCHAR_IOC* control commands. Only those need a closer look, the
+ * others are known to be plain data.
+ */
+#define frame_mark 'A'
+
+/**
+ * Per-connection framing buffer for newline delimited packets.
+ * Received bytes are appended at data[len]; only bytes past @scanned are
+ * searched for a newline, so a packet spread over many receives is never
+ * rescanned. data[0..complete) always ends with the last newline seen, and
+ * holds @packets packets, @marked of which start with frame_mark.
+ */
+struct frame_buf_t {
+    char *data;
+    size_t cap;
+    size_t len;
+    size_t scanned;
+    size_t complete;
+    size_t packets;
+    size_t marked;
+    bool open_marked;       // the packet after complete starts with frame_mark
+};
+
+/**
+ * Allocate the buffer with at least @param initial bytes of capacity,
+ * from the slab pools like its growth.
+ * @return 0 on success, -1 if the allocation failed.
+ */
+int frame_init(struct frame_buf_t *fb, size_t initial);
+
+/**
+ * Release the buffer.
+ */
+void frame_free(struct frame_buf_t *fb);
+
+/**
+ * Get room for the next receive, growing the buffer when it is full.
+ * Growth doubles the capacity, so a large packet costs amortised O(n).
+ * @param avail set to the number of bytes that may be written at the returned pointer.
+ * @return where to receive into, or NULL if the buffer could not grow.
+ */
+char *frame_space(struct frame_buf_t *fb, size_t *avail);
+
+/**
+ * Account for @param n bytes received into the space from frame_space and
+ * scan just those bytes, once, for the newlines that end packets, with
+ * the widest vector unit available (AVX2 or SSE2 on x86, memchr elsewhere).
+ * @return length of the complete prefix data[0..complete), 0 if no packet is complete yet.
+ */
+size_t frame_commit(struct frame_buf_t *fb, size_t n);
+
+/**
+ * Drop the first @param n bytes once they were handed off, keeping the
+ * partial packet that follows them. @param n covers every complete
+ * packet, their counts start over.
+ */
+void frame_consume(struct frame_buf_t *fb, size_t n);
+
+#endif
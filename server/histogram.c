@@ -0,0 +1,84 @@
+#include "histogram.h"
+#include <stdbool.h>
+#include "json.h"
+
+static unsigned bucket_of(uint64_t value)
+{
+    if (value >> hist_sub_bits == 0) return value;
+    unsigned shift = 63 - __builtin_clzll(value) - hist_sub_bits;
+    if (shift > hist_max_shift) return hist_bucket_count - 1;
+    return (shift << hist_sub_bits) + (value >> shift);
+}
+
+// Highest value that falls in a bucket
+static uint64_t bucket_top(unsigned bucket)
+{
+    if (bucket < 2u << hist_sub_bits) return bucket;
+    unsigned shift = (bucket >> hist_sub_bits) - 1;
+    uint64_t mantissa = bucket - (shift << hist_sub_bits);
+    return ((mantissa + 1) << shift) - 1;
+}
+
+// Single writer: a plain add, stored atomically so readers never see it torn
+static inline void bump(uint64_t *value, uint64_t n)
+{
+    __atomic_store_n(value, *value + n, __ATOMIC_RELAXED);
+}
+
+void histogram_record(struct histogram_t *h, uint64_t ns)
+{
+    bump(&h->counts[bucket_of(ns)], 1);
+    bump(&h->count, 1);
+    bump(&h->sum, ns);
+    if (ns > h->max) __atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+}
+
+void histogram_record_shared(struct histogram_t *h, uint64_t ns)
+{
+    __atomic_fetch_add(&h->counts[bucket_of(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, ns, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&h->max, &max, ns, true,
+                                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void histogram_merge(struct histogram_t *dst, const struct histogram_t *src)
+{
+    // The count is summed from the buckets, so the percentiles stay consistent
+    for (unsigned i = 0; i < hist_bucket_count; i++) {
+        uint64_t n = __atomic_load_n(&src->counts[i], __ATOMIC_RELAXED);
+        dst->counts[i] += n;
+        dst->count += n;
+    }
+    dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+    if (max > dst->max) dst->max = max;
+}
+
+uint64_t histogram_percentile(const struct histogram_t *h, double quantile)
+{
+    uint64_t rank = (uint64_t)(quantile * h->count + 0.5);
+    uint64_t seen = 0;
+    if (rank == 0) rank = 1;
+    for (unsigned i = 0; i < hist_bucket_count; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t top = bucket_top(i);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+size_t histogram_format(char *buf, size_t size, size_t len, const char *name, const struct histogram_t *h)
+{
+    return json_append(buf, size, len,
+                       "\"%s\":{\"count\":%llu,\"mean\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,"
+                       "\"p999\":%llu,\"max\":%llu}",
+                       name, (unsigned long long)h->count,
+                       (unsigned long long)(h->count ? h->sum / h->count : 0),
+                       (unsigned long long)histogram_percentile(h, 0.50), (unsigned long long)histogram_percentile(h, 0.90),
+                       (unsigned long long)histogram_percentile(h, 0.99), (unsigned long long)histogram_percentile(h, 0.999),
+                       (unsigned long long)h->max);
+}
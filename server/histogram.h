@@ -0,0 +1,54 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Log-linear buckets, HDR style: 2^hist_sub_bits buckets per power of two,
+// so a recorded value is off by at most 1/32. Values are in nanoseconds
+// and clamp at 2^(hist_max_shift + hist_sub_bits), about 18 minutes.
+#define hist_sub_bits 5
+#define hist_max_shift 35
+#define hist_bucket_count ((hist_max_shift + 2) << hist_sub_bits)
+
+/**
+ * Latency histogram. Readers only use relaxed loads, so a snapshot taken
+ * while it is written is off by the values in flight, never torn.
+ */
+struct histogram_t {
+    uint64_t counts[hist_bucket_count];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+};
+
+/**
+ * Record @param ns, for a histogram only the calling thread writes: plain
+ * adds stored atomically, no locked instruction.
+ */
+void histogram_record(struct histogram_t *h, uint64_t ns);
+
+/**
+ * Record @param ns, for a histogram several threads write.
+ */
+void histogram_record_shared(struct histogram_t *h, uint64_t ns);
+
+/**
+ * Add a snapshot of @param src to @param dst, which only the caller uses.
+ */
+void histogram_merge(struct histogram_t *dst, const struct histogram_t *src);
+
+/**
+ * The smallest bucket top with at least @param quantile of the values
+ * recorded at or below it, capped at the max.
+ */
+uint64_t histogram_percentile(const struct histogram_t *h, double quantile);
+
+/**
+ * Append "name":{count, mean, p50, p90, p99, p999, max} as JSON to
+ * @param buf of @param size, which holds @param len bytes already.
+ * @return the new length, which is past size once the buffer is full.
+ */
+size_t histogram_format(char *buf, size_t size, size_t len, const char *name, const struct histogram_t *h);
+
+#endif
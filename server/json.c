@@ -0,0 +1,13 @@
+#include "json.h"
+#include <stdarg.h>
+#include <stdio.h>
+
+size_t json_append(char *buf, size_t size, size_t len, const char *fmt, ...)
+{
+    if (len >= size) return len;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf + len, size - len, fmt, ap);
+    va_end(ap);
+    return n < 0 ? len : len + n;
+}
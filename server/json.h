@@ -0,0 +1,14 @@
+#ifndef JSON_H
+#define JSON_H
+
+#include <stddef.h>
+
+/**
+ * snprintf() appending at @param len to @param buf of @param size, for
+ * building the JSON stats lines piece by piece.
+ * @return the new length, which is past size once the buffer is full.
+ */
+size_t json_append(char *buf, size_t size, size_t len, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+#endif
@@ -0,0 +1,429 @@
+// Load generator for aesdsocket: many concurrent connections sending
+// tagged packets, each timed until its tag comes back in a replay. Prints
+// one CSV row (after a header unless -q) so runs can be collected and
+// compared, e.g. the blocking pool against -u or -e.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "histogram.h"
+
+#define delta_cmd "AESDCHAR_IOCDELTA:"
+#define tag_max 32
+#define recv_size (256 * 1024)
+#define max_events 256
+#define stall_ns 1000000000ull   // a send not echoed for this long at the end stalled
+
+enum mode_t_ { MODE_FULL, MODE_DELTA };
+
+struct config_t {
+    const char *host;
+    int port;
+    int connections;
+    int threads;
+    int duration_s;
+    size_t packet_size;     // bytes per packet, newline included
+    int batch;              // packets per send, only the last one is waited for
+    int fragments;          // writes each send is split into
+    double rate;            // packets per second per connection, 0 for closed loop
+    enum mode_t_ mode;
+    bool header;
+};
+
+struct config_t config = {
+    .host = "127.0.0.1",
+    .port = 9000,
+    .connections = 100,
+    .threads = 1,
+    .duration_s = 10,
+    .packet_size = 64,
+    .batch = 1,
+    .fragments = 1,
+    .rate = 0,
+    .mode = MODE_DELTA,
+    .header = true,
+};
+
+// One connection: at most one send in flight, done once its tag is echoed
+struct client_t {
+    int fd;
+    unsigned id;
+    uint64_t seq;
+    char *out;              // the send in flight
+    size_t out_len;
+    size_t out_sent;
+    char tag[tag_max];      // tag of its last packet, empty when idle
+    size_t tag_len;
+    char carry[tag_max];    // stream tail, for a tag split across reads
+    size_t carry_len;
+    uint64_t sent_ns;
+    uint64_t next_ns;       // earliest time for the next send, for -r
+};
+
+struct worker_t {
+    pthread_t thread;
+    int epollfd;
+    struct client_t *clients;
+    int count;
+    struct histogram_t latency;
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t rx_bytes;
+    uint64_t errors;
+};
+
+// Set by main when the run is over, polled by the workers
+bool stop = false;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Fill the send buffer with the next batch, the tag at the start of the last packet
+static void client_prepare(struct client_t *c)
+{
+    size_t size = config.packet_size;
+    memset(c->out, 'x', c->out_len);
+    for (int i = 0; i < config.batch; i++) {
+        c->out[(i + 1) * size - 1] = '\n';
+    }
+    c->tag_len = snprintf(c->tag, sizeof(c->tag), "#%u.%llu#", c->id, (unsigned long long)++c->seq);
+    memcpy(c->out + (config.batch - 1) * size, c->tag, c->tag_len);
+    c->out_sent = 0;
+}
+
+// Push the send in flight, one fragment per send() call.
+// Returns false if the connection failed.
+static bool client_flush(struct client_t *c)
+{
+    while (c->out_sent < c->out_len) {
+        size_t fragment = (c->out_len + config.fragments - 1) / config.fragments;
+        size_t next = (c->out_sent / fragment + 1) * fragment;
+        if (next > c->out_len) next = c->out_len;
+        ssize_t sent = send(c->fd, c->out + c->out_sent, next - c->out_sent, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        c->out_sent += sent;
+    }
+    return true;
+}
+
+static bool client_send(struct client_t *c, uint64_t now)
+{
+    client_prepare(c);
+    c->sent_ns = now;
+    return client_flush(c);
+}
+
+// Read what the server replays and look for the tag in flight.
+// Returns false if the connection failed.
+static bool client_receive(struct worker_t *w, struct client_t *c, char *buf)
+{
+    while (1) {
+        // The carry goes in front, so a tag split across reads is found too
+        memcpy(buf, c->carry, c->carry_len);
+        ssize_t got = recv(c->fd, buf + c->carry_len, recv_size, 0);
+        if (got == 0) return false;
+        if (got == -1) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        w->rx_bytes += got;
+        size_t len = c->carry_len + got;
+
+        if (c->tag_len > 0 && memmem(buf, len, c->tag, c->tag_len) != NULL) {
+            uint64_t now = now_ns();
+            histogram_record(&w->latency, now - c->sent_ns);
+            w->packets += config.batch;
+            w->bytes += c->out_len;
+            c->tag_len = 0;
+            c->carry_len = 0;
+            if (config.rate > 0) {
+                c->next_ns = c->sent_ns + (uint64_t)(1e9 * config.batch / config.rate);
+            }
+            continue;
+        }
+        c->carry_len = len < tag_max - 1 ? len : tag_max - 1;
+        memmove(c->carry, buf + len - c->carry_len, c->carry_len);
+    }
+}
+
+static void client_close(struct worker_t *w, struct client_t *c)
+{
+    epoll_ctl(w->epollfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    c->tag_len = 0;
+    w->errors++;
+}
+
+void *worker(void *arg)
+{
+    struct worker_t *w = arg;
+    struct epoll_event events[max_events];
+    char *buf = malloc(tag_max + recv_size);
+
+    if (buf == NULL) {
+        fprintf(stderr, "Failed to malloc\n");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t start = now_ns();
+    for (int i = 0; i < w->count; i++) {
+        if (w->clients[i].fd >= 0 && !client_send(&w->clients[i], start)) {
+            client_close(w, &w->clients[i]);
+        }
+    }
+
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+        // Wake for the earliest rate limited send
+        uint64_t now = now_ns();
+        int timeout = 100;
+        for (int i = 0; i < w->count; i++) {
+            struct client_t *c = &w->clients[i];
+            if (c->fd < 0 || c->tag_len > 0) continue;
+            if (c->next_ns <= now) {
+                if (!client_send(c, now)) client_close(w, c);
+                continue;
+            }
+            int ms = (c->next_ns - now) / 1000000 + 1;
+            if (ms < timeout) timeout = ms;
+        }
+
+        int nfds = epoll_wait(w->epollfd, events, max_events, timeout);
+        for (int i = 0; i < nfds; i++) {
+            struct client_t *c = events[i].data.ptr;
+            if (c->fd < 0) continue;
+            bool ok = true;
+            if (events[i].events & EPOLLOUT) ok = client_flush(c);
+            if (ok && events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) ok = client_receive(w, c, buf);
+            if (!ok) {
+                client_close(w, c);
+                continue;
+            }
+            // Closed loop: the next send goes out as soon as this one is echoed
+            if (c->tag_len == 0 && config.rate == 0 && !__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+                if (!client_send(c, now_ns())) client_close(w, c);
+            }
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static int client_connect(struct client_t *c, const struct sockaddr_in *addr)
+{
+    int one = 1;
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->fd == -1) return -1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, (const struct sockaddr *)addr, sizeof(*addr)) == -1) {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    // Delta mode: after the handshake each replay is only what is new
+    if (config.mode == MODE_DELTA &&
+        send(c->fd, delta_cmd "\n", strlen(delta_cmd "\n"), MSG_NOSIGNAL) == -1) {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [-H host] [-p port] [-c connections] [-t threads] [-d seconds] [-s packet_bytes]"
+            " [-b batch] [-f fragments] [-r packets_per_s] [-m full|delta] [-q]\n", argv0);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:c:t:d:s:b:f:r:m:q")) != -1) {
+        switch (opt) {
+        case 'H':
+            config.host = optarg;
+            break;
+        case 'p':
+            config.port = atoi(optarg);
+            break;
+        case 'c':
+            config.connections = atoi(optarg);
+            break;
+        case 't':
+            config.threads = atoi(optarg);
+            break;
+        case 'd':
+            config.duration_s = atoi(optarg);
+            break;
+        case 's':
+            config.packet_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            config.batch = atoi(optarg);
+            break;
+        case 'f':
+            config.fragments = atoi(optarg);
+            break;
+        case 'r':
+            config.rate = atof(optarg);
+            break;
+        case 'm':
+            if (strcmp(optarg, "full") == 0) {
+                config.mode = MODE_FULL;
+            } else if (strcmp(optarg, "delta") == 0) {
+                config.mode = MODE_DELTA;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        case 'q':
+            config.header = false;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (config.connections <= 0 || config.threads <= 0 || config.duration_s <= 0 || config.batch <= 0 ||
+        config.fragments <= 0 || config.rate < 0) {
+        usage(argv[0]);
+    }
+    // The whole tag and the newline must fit in a packet, a cut tag never matches
+    if (config.packet_size <= sizeof(((struct client_t *)0)->tag)) {
+        fprintf(stderr, "Packet size must be more than %zu bytes\n", sizeof(((struct client_t *)0)->tag));
+        exit(EXIT_FAILURE);
+    }
+    if (config.threads > config.connections) config.threads = config.connections;
+
+    // Thousands of connections need the fd limit raised as far as allowed
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(config.port) };
+    if (inet_pton(AF_INET, config.host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid host %s\n", config.host);
+        exit(EXIT_FAILURE);
+    }
+
+    struct worker_t *workers = calloc(config.threads, sizeof(struct worker_t));
+    struct client_t *clients = calloc(config.connections, sizeof(struct client_t));
+    size_t out_len = config.packet_size * config.batch;
+    char *out = malloc(out_len * config.connections);
+    if (workers == NULL || clients == NULL || out == NULL) {
+        fprintf(stderr, "Failed to malloc\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Connect everything first, so the clock only runs under full load
+    uint64_t connect_errors = 0;
+    for (int i = 0; i < config.connections; i++) {
+        struct client_t *c = &clients[i];
+        c->id = i;
+        c->out = out + i * out_len;
+        c->out_len = out_len;
+        if (client_connect(c, &addr) == -1) connect_errors++;
+    }
+    if (connect_errors == (uint64_t)config.connections) {
+        fprintf(stderr, "Failed to connect to %s:%d\n", config.host, config.port);
+        exit(EXIT_FAILURE);
+    }
+
+    for (int t = 0; t < config.threads; t++) {
+        struct worker_t *w = &workers[t];
+        int first = (long)config.connections * t / config.threads;
+        int last = (long)config.connections * (t + 1) / config.threads;
+        w->clients = clients + first;
+        w->count = last - first;
+        w->epollfd = epoll_create1(0);
+        if (w->epollfd == -1) {
+            fprintf(stderr, "Failed to create epoll instance\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < w->count; i++) {
+            struct client_t *c = &w->clients[i];
+            if (c->fd < 0) continue;
+            struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = c };
+            int flags = fcntl(c->fd, F_GETFL, 0);
+            if (flags == -1 || fcntl(c->fd, F_SETFL, flags | O_NONBLOCK) == -1 ||
+                epoll_ctl(w->epollfd, EPOLL_CTL_ADD, c->fd, &ev) == -1) {
+                close(c->fd);
+                c->fd = -1;
+                connect_errors++;
+            }
+        }
+    }
+
+    uint64_t start = now_ns();
+    for (int t = 0; t < config.threads; t++) {
+        if (pthread_create(&workers[t].thread, NULL, worker, &workers[t]) != 0) {
+            fprintf(stderr, "Failed to create thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    sleep(config.duration_s);
+    __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+    struct histogram_t *latency = calloc(1, sizeof(struct histogram_t));
+    uint64_t packets = 0, bytes = 0, rx_bytes = 0, errors = connect_errors;
+    for (int t = 0; t < config.threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+        histogram_merge(latency, &workers[t].latency);
+        packets += workers[t].packets;
+        bytes += workers[t].bytes;
+        rx_bytes += workers[t].rx_bytes;
+        errors += workers[t].errors;
+    }
+    uint64_t end = now_ns();
+    double elapsed = (end - start) / 1e9;
+
+    // Connections still waiting on an old send got no reply, they count as errors too
+    uint64_t stalled = 0;
+    for (int i = 0; i < config.connections; i++) {
+        const struct client_t *c = &clients[i];
+        if (c->fd >= 0 && c->tag_len > 0 && end - c->sent_ns >= stall_ns) stalled++;
+    }
+    errors += stalled;
+
+    if (config.header) {
+        printf("mode,connections,threads,packet_bytes,batch,fragments,rate,seconds,packets,bytes,"
+               "packets_per_s,mb_per_s,rx_mb,p50_us,p90_us,p99_us,p999_us,max_us,errors,stalled\n");
+    }
+    printf("%s,%d,%d,%zu,%d,%d,%g,%.2f,%llu,%llu,%.0f,%.3f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%llu,%llu\n",
+           config.mode == MODE_FULL ? "full" : "delta", config.connections, config.threads, config.packet_size,
+           config.batch, config.fragments, config.rate, elapsed,
+           (unsigned long long)packets, (unsigned long long)bytes, packets / elapsed, bytes / elapsed / 1e6,
+           rx_bytes / 1e6, histogram_percentile(latency, 0.50) / 1e3, histogram_percentile(latency, 0.90) / 1e3,
+           histogram_percentile(latency, 0.99) / 1e3, histogram_percentile(latency, 0.999) / 1e3,
+           latency->max / 1e3, (unsigned long long)errors, (unsigned long long)stalled);
+
+    for (int i = 0; i < config.connections; i++) {
+        if (clients[i].fd >= 0) close(clients[i].fd);
+    }
+    free(latency);
+    free(out);
+    free(clients);
+    free(workers);
+    return 0;
+}
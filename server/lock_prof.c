@@ -0,0 +1,140 @@
+#include "lock_prof.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "json.h"
+
+#define held_max 8
+#define report_max (64 * 1024)
+
+bool lock_prof_enabled = false;
+
+// Every call site used so far, pushed on first use and never removed
+static struct lock_site_t *all_sites = NULL;
+
+// Locks the calling thread holds, innermost last, for the hold times
+struct held_t {
+    pthread_mutex_t *mutex;
+    struct lock_stats_t *stats;
+    uint64_t acquired_ns;
+};
+static __thread struct held_t held[held_max];
+static __thread int held_count = 0;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void report_at_exit(void)
+{
+    char *report = malloc(report_max);
+    if (report == NULL) return;
+    size_t len = lock_prof_format(report, report_max);
+    fwrite(report, 1, len, stderr);
+    free(report);
+}
+
+__attribute__((constructor))
+static void lock_prof_init(void)
+{
+    if (getenv("LOCK_PROF") != NULL) {
+        lock_prof_enable();
+        atexit(report_at_exit);
+    }
+}
+
+void lock_prof_enable(void)
+{
+    __atomic_store_n(&lock_prof_enabled, true, __ATOMIC_RELEASE);
+}
+
+// The stats of a site, allocated and registered by whichever thread gets there first
+static struct lock_stats_t *site_stats(struct lock_site_t *site)
+{
+    struct lock_stats_t *stats = __atomic_load_n(&site->stats, __ATOMIC_ACQUIRE);
+    if (stats != NULL) return stats;
+
+    struct lock_stats_t *fresh = calloc(1, sizeof(struct lock_stats_t));
+    if (fresh == NULL) return NULL;
+    if (!__atomic_compare_exchange_n(&site->stats, &stats, fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(fresh);
+        return stats;
+    }
+    struct lock_site_t *head = __atomic_load_n(&all_sites, __ATOMIC_RELAXED);
+    do {
+        site->next = head;
+    } while (!__atomic_compare_exchange_n(&all_sites, &head, site, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return fresh;
+}
+
+int lock_prof_lock(pthread_mutex_t *mutex, struct lock_site_t *site)
+{
+    struct lock_stats_t *stats = site_stats(site);
+    uint64_t start = now_ns();
+
+    // A failed trylock is the contention, only then is the wait timed
+    int rc = pthread_mutex_trylock(mutex);
+    bool contended = rc == EBUSY;
+    if (contended) {
+        rc = pthread_mutex_lock(mutex);
+    }
+    if (rc != 0) return rc;
+    uint64_t acquired = contended ? now_ns() : start;
+
+    if (stats != NULL) {
+        __atomic_fetch_add(&stats->acquires, 1, __ATOMIC_RELAXED);
+        if (contended) __atomic_fetch_add(&stats->contended, 1, __ATOMIC_RELAXED);
+        histogram_record_shared(&stats->wait, acquired - start);
+        if (held_count < held_max) {
+            held[held_count].mutex = mutex;
+            held[held_count].stats = stats;
+            held[held_count].acquired_ns = acquired;
+            held_count++;
+        }
+    }
+    return 0;
+}
+
+int lock_prof_unlock(pthread_mutex_t *mutex)
+{
+    // Usually the innermost, but locks need not be released in order
+    for (int i = held_count - 1; i >= 0; i--) {
+        if (held[i].mutex != mutex) continue;
+        histogram_record_shared(&held[i].stats->hold, now_ns() - held[i].acquired_ns);
+        for (; i + 1 < held_count; i++) {
+            held[i] = held[i + 1];
+        }
+        held_count--;
+        break;
+    }
+    return pthread_mutex_unlock(mutex);
+}
+
+size_t lock_prof_format(char *buf, size_t size)
+{
+    size_t len = json_append(buf, size, 0, "{\"locks\":[");
+
+    for (struct lock_site_t *site = __atomic_load_n(&all_sites, __ATOMIC_ACQUIRE); site != NULL; site = site->next) {
+        const struct lock_stats_t *stats = site->stats;
+        struct histogram_t snapshot;
+        len = json_append(buf, size, len, "{\"site\":\"%s:%d\",\"lock\":\"%s\",\"acquires\":%llu,\"contended\":%llu,",
+                          site->file, site->line, site->lock,
+                          (unsigned long long)__atomic_load_n(&stats->acquires, __ATOMIC_RELAXED),
+                          (unsigned long long)__atomic_load_n(&stats->contended, __ATOMIC_RELAXED));
+        memset(&snapshot, 0, sizeof(snapshot));
+        histogram_merge(&snapshot, &stats->wait);
+        len = histogram_format(buf, size, len, "wait_ns", &snapshot);
+        memset(&snapshot, 0, sizeof(snapshot));
+        histogram_merge(&snapshot, &stats->hold);
+        len = json_append(buf, size, len, ",");
+        len = histogram_format(buf, size, len, "hold_ns", &snapshot);
+        len = json_append(buf, size, len, "}%s", site->next != NULL ? "," : "");
+    }
+    len = json_append(buf, size, len, "]}\n");
+    return len < size ? len : size - 1;
+}
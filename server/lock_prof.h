@@ -0,0 +1,71 @@
+#ifndef LOCK_PROF_H
+#define LOCK_PROF_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "histogram.h"
+
+/**
+ * What one call site of prof_mutex_lock() measured: how often it took
+ * the lock, how often it had to wait for it, the wait and the time the
+ * lock was then held until prof_mutex_unlock().
+ */
+struct lock_stats_t {
+    uint64_t acquires;
+    uint64_t contended;
+    struct histogram_t wait;
+    struct histogram_t hold;
+};
+
+/**
+ * A call site, static in the expansion of prof_mutex_lock(). Its stats
+ * are allocated and it is registered on its first profiled use.
+ */
+struct lock_site_t {
+    const char *file;
+    int line;
+    const char *lock;               // the mutex expression as written
+    struct lock_stats_t *stats;
+    struct lock_site_t *next;
+};
+
+/**
+ * Set once profiling is on. Until then the wrappers are a predicted
+ * branch in front of the plain pthread call.
+ */
+extern bool lock_prof_enabled;
+
+/**
+ * Turn profiling on, before the threads to profile start. Setting the
+ * LOCK_PROF environment variable does it at load time too, and reports
+ * to stderr at exit.
+ */
+void lock_prof_enable(void);
+
+int lock_prof_lock(pthread_mutex_t *mutex, struct lock_site_t *site);
+int lock_prof_unlock(pthread_mutex_t *mutex);
+
+/**
+ * Format the stats of every call site as a single line JSON object.
+ * @return the length written to @param buf, truncated at @param size.
+ */
+size_t lock_prof_format(char *buf, size_t size);
+
+/**
+ * Drop-in replacements for pthread_mutex_lock/unlock that profile each
+ * call site. The hold time is measured per thread, from the lock to the
+ * matching unlock, so a mutex that is also handed to pthread_cond_wait()
+ * would be misreported and should stay unwrapped.
+ */
+#define prof_mutex_lock(mutex) \
+    (__builtin_expect(lock_prof_enabled, 0) ? \
+     ({ static struct lock_site_t lock_site_ = { .file = __FILE__, .line = __LINE__, .lock = #mutex }; \
+        lock_prof_lock((mutex), &lock_site_); }) : \
+     pthread_mutex_lock(mutex))
+
+#define prof_mutex_unlock(mutex) \
+    (__builtin_expect(lock_prof_enabled, 0) ? lock_prof_unlock(mutex) : pthread_mutex_unlock(mutex))
+
+#endif
@@ -0,0 +1,86 @@
+#include "metrics.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "json.h"
+
+static const char *counter_names[METRIC_COUNTERS] = {
+    "accepts", "bytes_in", "bytes_out", "packets", "replays", "replay_bytes",
+};
+
+static const char *hist_names[METRIC_HISTS] = {
+    "recv_to_append_ns", "append_to_replay_ns", "replay_ns",
+};
+
+// Every thread's metrics, pushed on first use and never removed
+static struct metrics_t *all_metrics = NULL;
+static __thread struct metrics_t *local_metrics = NULL;
+
+uint64_t metrics_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// The calling thread's metrics, NULL if they could not be allocated
+static struct metrics_t *metrics_local(void)
+{
+    if (local_metrics == NULL && (local_metrics = calloc(1, sizeof(struct metrics_t))) != NULL) {
+        struct metrics_t *head = __atomic_load_n(&all_metrics, __ATOMIC_RELAXED);
+        do {
+            local_metrics->next = head;
+        } while (!__atomic_compare_exchange_n(&all_metrics, &head, local_metrics, true,
+                                              __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    return local_metrics;
+}
+
+// Single writer: a plain add, stored atomically so readers never see it torn
+void metrics_add(enum metric_counter_t counter, uint64_t n)
+{
+    struct metrics_t *m = metrics_local();
+    if (m != NULL) {
+        __atomic_store_n(&m->counters[counter], m->counters[counter] + n, __ATOMIC_RELAXED);
+    }
+}
+
+void metrics_record(enum metric_hist_t hist, uint64_t ns)
+{
+    struct metrics_t *m = metrics_local();
+    if (m != NULL) histogram_record(&m->hists[hist], ns);
+}
+
+size_t metrics_format(char *buf, size_t size)
+{
+    uint64_t counters[METRIC_COUNTERS] = { 0 };
+    struct histogram_t *hist = calloc(1, sizeof(struct histogram_t));
+    size_t len = 0;
+
+    if (hist == NULL) return 0;
+    struct metrics_t *head = __atomic_load_n(&all_metrics, __ATOMIC_ACQUIRE);
+    for (struct metrics_t *m = head; m != NULL; m = m->next) {
+        for (int c = 0; c < METRIC_COUNTERS; c++) {
+            counters[c] += __atomic_load_n(&m->counters[c], __ATOMIC_RELAXED);
+        }
+    }
+    len = json_append(buf, size, len, "{");
+    for (int c = 0; c < METRIC_COUNTERS; c++) {
+        len = json_append(buf, size, len, "\"%s\":%llu,", counter_names[c], (unsigned long long)counters[c]);
+    }
+
+    for (int k = 0; k < METRIC_HISTS; k++) {
+        // Merge the threads' histograms into one snapshot
+        memset(hist, 0, sizeof(*hist));
+        for (struct metrics_t *m = head; m != NULL; m = m->next) {
+            histogram_merge(hist, &m->hists[k]);
+        }
+        len = histogram_format(buf, size, len, hist_names[k], hist);
+        if (k + 1 < METRIC_HISTS) len = json_append(buf, size, len, ",");
+    }
+    len = json_append(buf, size, len, "}\n");
+    free(hist);
+    return len < size ? len : size - 1;
+}
@@ -0,0 +1,58 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "histogram.h"
+
+enum metric_counter_t {
+    METRIC_ACCEPTS,
+    METRIC_BYTES_IN,
+    METRIC_BYTES_OUT,       // replays, replies and subscriber feeds
+    METRIC_PACKETS,
+    METRIC_REPLAYS,
+    METRIC_REPLAY_BYTES,
+    METRIC_COUNTERS
+};
+
+enum metric_hist_t {
+    METRIC_RECV_TO_APPEND,  // recv returned to the packets being in the file
+    METRIC_APPEND_TO_REPLAY,// packets in the file to the first byte of their replay sent
+    METRIC_REPLAY_TIME,     // first to last byte of a replay
+    METRIC_HISTS
+};
+
+/**
+ * Metrics of one thread. Each thread only writes its own, with relaxed
+ * atomic stores and no lock or locked instruction; readers sum them all.
+ * They are allocated on first use and live until the process exits.
+ */
+struct metrics_t {
+    uint64_t counters[METRIC_COUNTERS];
+    struct histogram_t hists[METRIC_HISTS];
+    struct metrics_t *next;
+};
+
+/**
+ * Monotonic clock in nanoseconds, for the histograms.
+ */
+uint64_t metrics_now(void);
+
+/**
+ * Add @param n to @param counter of the calling thread.
+ */
+void metrics_add(enum metric_counter_t counter, uint64_t n);
+
+/**
+ * Record @param ns in @param hist of the calling thread.
+ */
+void metrics_record(enum metric_hist_t hist, uint64_t ns);
+
+/**
+ * Format the totals over all threads as a single line JSON object, with
+ * count, mean, p50, p90, p99, p999 and max for each histogram.
+ * @return the length written to @param buf, truncated at @param size.
+ */
+size_t metrics_format(char *buf, size_t size);
+
+#endif
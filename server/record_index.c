@@ -0,0 +1,144 @@
+#include "record_index.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Make room for one more item at items[head + count], reusing the trimmed
+// front of the array or doubling it. Returns 0 on success, -1 if it could not grow.
+static int reserve(void **items, size_t size, size_t *cap, size_t *head, size_t count)
+{
+    if (*head + count < *cap) {
+        return 0;
+    }
+    if (*head > 0 && *head >= count) {
+        // At least half of the array was trimmed, reuse it
+        memmove(*items, (char *)*items + *head * size, count * size);
+        *head = 0;
+        return 0;
+    }
+    size_t grown = *cap ? *cap * 2 : 1024;
+    void *resized = realloc(*items, grown * size);
+    if (resized == NULL) {
+        return -1;
+    }
+    *items = resized;
+    *cap = grown;
+    return 0;
+}
+
+void record_index_init(struct record_index_t *idx, size_t first)
+{
+    memset(idx, 0, sizeof(*idx));
+    idx->first = first;
+}
+
+void record_index_free(struct record_index_t *idx)
+{
+    free(idx->starts);
+    memset(idx, 0, sizeof(*idx));
+}
+
+int record_index_push(struct record_index_t *idx, off_t start, off_t end)
+{
+    if (reserve((void **)&idx->starts, sizeof(off_t), &idx->cap, &idx->head, idx->count) == -1) {
+        return -1;
+    }
+    idx->starts[idx->head + idx->count] = start;
+    idx->count++;
+    idx->tail = end;
+    return 0;
+}
+
+int record_index_lookup(const struct record_index_t *idx, size_t record, off_t *start, off_t *end)
+{
+    if (record < idx->first || record - idx->first >= idx->count) {
+        return -1;
+    }
+    size_t i = idx->head + (record - idx->first);
+    *start = idx->starts[i];
+    *end = record - idx->first + 1 < idx->count ? idx->starts[i + 1] : idx->tail;
+    return 0;
+}
+
+void record_index_trim(struct record_index_t *idx, off_t base)
+{
+    while (idx->count > 0 && idx->starts[idx->head] < base) {
+        idx->head++;
+        idx->count--;
+        idx->first++;
+    }
+    if (idx->count == 0) {
+        idx->head = 0;
+    }
+}
+
+void record_index_cap(struct record_index_t *idx, size_t max)
+{
+    if (idx->count > max) {
+        record_index_trim(idx, idx->starts[idx->head + idx->count - max]);
+    }
+}
+
+void time_index_init(struct time_index_t *idx)
+{
+    memset(idx, 0, sizeof(*idx));
+}
+
+void time_index_free(struct time_index_t *idx)
+{
+    free(idx->markers);
+    memset(idx, 0, sizeof(*idx));
+}
+
+int time_index_push(struct time_index_t *idx, time_t when, off_t offset)
+{
+    if (idx->count > 0 && when < idx->markers[idx->head + idx->count - 1].when) {
+        return 0;
+    }
+    if (reserve((void **)&idx->markers, sizeof(struct time_marker_t), &idx->cap, &idx->head, idx->count) == -1) {
+        return -1;
+    }
+    idx->markers[idx->head + idx->count].when = when;
+    idx->markers[idx->head + idx->count].offset = offset;
+    idx->count++;
+    return 0;
+}
+
+// Number of markers at or before when, i.e. the position of the first later one
+static size_t upper_bound(const struct time_index_t *idx, time_t when)
+{
+    const struct time_marker_t *m = idx->markers + idx->head;
+    size_t lo = 0, hi = idx->count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (m[mid].when <= when) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+off_t time_index_floor(const struct time_index_t *idx, time_t when)
+{
+    size_t i = upper_bound(idx, when);
+    return i > 0 ? idx->markers[idx->head + i - 1].offset : -1;
+}
+
+off_t time_index_after(const struct time_index_t *idx, time_t when)
+{
+    size_t i = upper_bound(idx, when);
+    return i < idx->count ? idx->markers[idx->head + i].offset : -1;
+}
+
+void time_index_trim(struct time_index_t *idx, off_t base)
+{
+    while (idx->count > 0 && idx->markers[idx->head].offset < base) {
+        idx->head++;
+        idx->count--;
+    }
+    if (idx->count == 0) {
+        idx->head = 0;
+    }
+}
@@ -0,0 +1,111 @@
+#ifndef RECORD_INDEX_H
+#define RECORD_INDEX_H
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+
+/**
+ * In-memory index of packet boundaries: record number to the logical
+ * offset of its first byte. Records are numbered from 0 in the order they
+ * were appended; trimming the oldest ones keeps the numbers of the rest.
+ * Not thread safe, the caller serialises access.
+ */
+struct record_index_t {
+    off_t *starts;      // starts[head..head+count) hold records first..first+count
+    size_t cap;
+    size_t head;
+    size_t count;
+    size_t first;       // number of the oldest indexed record
+    off_t tail;         // end of the newest indexed record
+};
+
+/**
+ * Start an empty index whose first record will be number @param first.
+ */
+void record_index_init(struct record_index_t *idx, size_t first);
+
+/**
+ * Release the index.
+ */
+void record_index_free(struct record_index_t *idx);
+
+/**
+ * Add the next complete record, spanning [@param start, @param end).
+ * Growth doubles the capacity, so indexing is amortised O(1) per record.
+ * @return 0 on success, -1 if the index could not grow.
+ */
+int record_index_push(struct record_index_t *idx, off_t start, off_t end);
+
+/**
+ * Find the byte range of record @param record.
+ * @return 0 with *start and *end set, or -1 if the record is not indexed
+ * (trimmed, or not complete yet).
+ */
+int record_index_lookup(const struct record_index_t *idx, size_t record, off_t *start, off_t *end);
+
+/**
+ * Drop the records starting before @param base, once the data they point
+ * at is gone.
+ */
+void record_index_trim(struct record_index_t *idx, off_t base);
+
+/**
+ * Drop the oldest records until at most @param max are left.
+ */
+void record_index_cap(struct record_index_t *idx, size_t max);
+
+struct time_marker_t {
+    time_t when;
+    off_t offset;
+};
+
+/**
+ * Sparse index of time markers, the timestamp records: wall-clock time to
+ * the logical offset of the marker. Times never decrease, so lookups are
+ * a binary search. Not thread safe, the caller serialises access.
+ */
+struct time_index_t {
+    struct time_marker_t *markers;  // markers[head..head+count)
+    size_t cap;
+    size_t head;
+    size_t count;
+};
+
+/**
+ * Start an empty index.
+ */
+void time_index_init(struct time_index_t *idx);
+
+/**
+ * Release the index.
+ */
+void time_index_free(struct time_index_t *idx);
+
+/**
+ * Add a marker for time @param when at @param offset. A marker older than
+ * the newest one (the clock went back) is skipped to keep the order.
+ * @return 0 on success, -1 if the index could not grow.
+ */
+int time_index_push(struct time_index_t *idx, time_t when, off_t offset);
+
+/**
+ * Find the last marker at or before @param when, where data received at
+ * that time starts at the latest.
+ * @return its offset, or -1 if every marker is later.
+ */
+off_t time_index_floor(const struct time_index_t *idx, time_t when);
+
+/**
+ * Find the first marker after @param when, where data received up to that
+ * time ends at the latest.
+ * @return its offset, or -1 if no marker is later.
+ */
+off_t time_index_after(const struct time_index_t *idx, time_t when);
+
+/**
+ * Drop the markers before @param base, once the data they point at is gone.
+ */
+void time_index_trim(struct time_index_t *idx, off_t base);
+
+#endif
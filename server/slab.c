@@ -0,0 +1,268 @@
+#include "slab.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "json.h"
+
+#define slab_batch 16                       // buffers moved to or from the depot at once
+#define thread_cache_bytes (256 * 1024)     // per class and thread
+#define depot_bytes (4 * 1024 * 1024)       // per class
+
+// Counts per class, and one more for the sizes above the classes
+struct slab_stats_t {
+    uint64_t hits;
+    uint64_t refills;
+    uint64_t misses;
+    uint64_t frees;
+    uint64_t releases;
+};
+
+// One thread's free lists, linked through the first word of each buffer.
+// Only the owner writes the stats, readers load them relaxed.
+struct slab_cache_t {
+    void *head[slab_classes];
+    unsigned count[slab_classes];
+    struct slab_stats_t stats[slab_classes + 1];
+    bool owned;                     // cleared when the owner exits, the cache is then reused
+    struct slab_cache_t *next;
+} __attribute__((aligned(slab_line)));
+
+struct slab_depot_t {
+    pthread_mutex_t lock;
+    void *head;
+    unsigned count;
+} __attribute__((aligned(slab_line)));
+
+static struct slab_depot_t depots[slab_classes] = {
+    [0 ... slab_classes - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER },
+};
+
+// Every thread's cache, pushed on first use and never freed
+static struct slab_cache_t *all_caches = NULL;
+static __thread struct slab_cache_t *local_cache = NULL;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+// Single writer: a plain add, stored atomically so readers never see it torn
+static inline void bump(uint64_t *value)
+{
+    __atomic_store_n(value, *value + 1, __ATOMIC_RELAXED);
+}
+
+// Class of a size, -1 above the largest
+static int class_of(size_t size)
+{
+    if (size <= (size_t)1 << slab_min_shift) return 0;
+    if (size > (size_t)1 << slab_max_shift) return -1;
+    return 64 - __builtin_clzll(size - 1) - slab_min_shift;
+}
+
+static size_t class_size(int c)
+{
+    return (size_t)1 << (c + slab_min_shift);
+}
+
+// How many buffers of a class a thread keeps, and the depot
+static unsigned cache_limit(int c)
+{
+    unsigned limit = thread_cache_bytes / class_size(c);
+    return limit < 4 ? 4 : limit;
+}
+
+static unsigned depot_limit(int c)
+{
+    unsigned limit = depot_bytes / class_size(c);
+    return limit < 8 ? 8 : limit;
+}
+
+static unsigned batch_of(int c)
+{
+    unsigned batch = cache_limit(c) / 2;
+    return batch < slab_batch ? batch : slab_batch;
+}
+
+static void *pop(struct slab_cache_t *cache, int c)
+{
+    void *buf = cache->head[c];
+    cache->head[c] = *(void **)buf;
+    cache->count[c]--;
+    return buf;
+}
+
+static void push(struct slab_cache_t *cache, int c, void *buf)
+{
+    *(void **)buf = cache->head[c];
+    cache->head[c] = buf;
+    cache->count[c]++;
+}
+
+// Move up to a batch from the depot to the thread's list.
+// Returns how many were moved.
+static unsigned depot_take(struct slab_cache_t *cache, int c)
+{
+    struct slab_depot_t *depot = &depots[c];
+    unsigned moved = 0;
+
+    pthread_mutex_lock(&depot->lock);
+    while (depot->count > 0 && moved < batch_of(c)) {
+        void *buf = depot->head;
+        depot->head = *(void **)buf;
+        depot->count--;
+        push(cache, c, buf);
+        moved++;
+    }
+    pthread_mutex_unlock(&depot->lock);
+    return moved;
+}
+
+// Move n buffers from the thread's list to the depot, freeing what it has no room for
+static void depot_give(struct slab_cache_t *cache, int c, unsigned n)
+{
+    struct slab_depot_t *depot = &depots[c];
+    void *surplus = NULL;
+
+    pthread_mutex_lock(&depot->lock);
+    while (n-- > 0 && cache->count[c] > 0) {
+        void *buf = pop(cache, c);
+        if (depot->count < depot_limit(c)) {
+            *(void **)buf = depot->head;
+            depot->head = buf;
+            depot->count++;
+        } else {
+            *(void **)buf = surplus;
+            surplus = buf;
+        }
+    }
+    pthread_mutex_unlock(&depot->lock);
+
+    while (surplus != NULL) {
+        void *next = *(void **)surplus;
+        free(surplus);
+        bump(&cache->stats[c].releases);
+        surplus = next;
+    }
+}
+
+// A thread that exits hands its buffers to the depot
+static void cache_release(void *arg)
+{
+    struct slab_cache_t *cache = arg;
+    for (int c = 0; c < slab_classes; c++) {
+        depot_give(cache, c, cache->count[c]);
+    }
+    __atomic_store_n(&cache->owned, false, __ATOMIC_RELEASE);
+}
+
+static void cache_key_init(void)
+{
+    pthread_key_create(&cache_key, cache_release);
+}
+
+// The calling thread's cache, one left by a thread that exited or a new
+// one. NULL if it could not be allocated.
+static struct slab_cache_t *cache_local(void)
+{
+    if (local_cache != NULL) return local_cache;
+
+    pthread_once(&cache_key_once, cache_key_init);
+    struct slab_cache_t *cache;
+    for (cache = __atomic_load_n(&all_caches, __ATOMIC_ACQUIRE); cache != NULL; cache = cache->next) {
+        bool owned = false;
+        if (!__atomic_load_n(&cache->owned, __ATOMIC_RELAXED) &&
+            __atomic_compare_exchange_n(&cache->owned, &owned, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (cache == NULL) {
+        if ((cache = aligned_alloc(slab_line, sizeof(struct slab_cache_t))) == NULL) return NULL;
+        *cache = (struct slab_cache_t){ .owned = true };
+        struct slab_cache_t *head = __atomic_load_n(&all_caches, __ATOMIC_RELAXED);
+        do {
+            cache->next = head;
+        } while (!__atomic_compare_exchange_n(&all_caches, &head, cache, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    pthread_setspecific(cache_key, cache);
+    local_cache = cache;
+    return cache;
+}
+
+size_t slab_size(size_t size)
+{
+    int c = class_of(size);
+    return c < 0 ? size : class_size(c);
+}
+
+void *slab_alloc(size_t size)
+{
+    int c = class_of(size);
+    struct slab_cache_t *cache = cache_local();
+
+    if (c < 0) {
+        if (cache != NULL) bump(&cache->stats[slab_classes].misses);
+        return malloc(size);
+    }
+    if (cache == NULL) {
+        return aligned_alloc(slab_line, class_size(c));
+    }
+    if (cache->count[c] > 0) {
+        bump(&cache->stats[c].hits);
+        return pop(cache, c);
+    }
+    if (depot_take(cache, c) > 0) {
+        bump(&cache->stats[c].refills);
+        return pop(cache, c);
+    }
+    bump(&cache->stats[c].misses);
+    return aligned_alloc(slab_line, class_size(c));
+}
+
+void slab_free(void *buf, size_t size)
+{
+    if (buf == NULL) return;
+
+    int c = class_of(size);
+    struct slab_cache_t *cache = cache_local();
+    if (c < 0 || cache == NULL) {
+        if (cache != NULL) {
+            bump(&cache->stats[slab_classes].frees);
+            bump(&cache->stats[slab_classes].releases);
+        }
+        free(buf);
+        return;
+    }
+    push(cache, c, buf);
+    bump(&cache->stats[c].frees);
+    if (cache->count[c] > cache_limit(c)) {
+        depot_give(cache, c, batch_of(c));
+    }
+}
+
+size_t slab_format(char *buf, size_t size)
+{
+    struct slab_stats_t sum[slab_classes + 1] = { 0 };
+    bool first = true;
+
+    for (struct slab_cache_t *cache = __atomic_load_n(&all_caches, __ATOMIC_ACQUIRE); cache != NULL; cache = cache->next) {
+        for (int c = 0; c <= slab_classes; c++) {
+            sum[c].hits += __atomic_load_n(&cache->stats[c].hits, __ATOMIC_RELAXED);
+            sum[c].refills += __atomic_load_n(&cache->stats[c].refills, __ATOMIC_RELAXED);
+            sum[c].misses += __atomic_load_n(&cache->stats[c].misses, __ATOMIC_RELAXED);
+            sum[c].frees += __atomic_load_n(&cache->stats[c].frees, __ATOMIC_RELAXED);
+            sum[c].releases += __atomic_load_n(&cache->stats[c].releases, __ATOMIC_RELAXED);
+        }
+    }
+
+    size_t len = json_append(buf, size, 0, "{\"slab\":[");
+    for (int c = 0; c <= slab_classes; c++) {
+        if (sum[c].hits + sum[c].refills + sum[c].misses + sum[c].frees == 0) continue;
+        // The sizes above the classes are listed with size 0
+        len = json_append(buf, size, len, "%s{\"size\":%zu,\"hits\":%llu,\"refills\":%llu,\"misses\":%llu,"
+                          "\"frees\":%llu,\"releases\":%llu}", first ? "" : ",",
+                          c < slab_classes ? class_size(c) : 0, (unsigned long long)sum[c].hits,
+                          (unsigned long long)sum[c].refills, (unsigned long long)sum[c].misses,
+                          (unsigned long long)sum[c].frees, (unsigned long long)sum[c].releases);
+        first = false;
+    }
+    len = json_append(buf, size, len, "]}\n");
+    return len < size ? len : size - 1;
+}
@@ -0,0 +1,50 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Size-classed buffer pools for what every connection allocates and
+ * frees: contexts, receive buffers, io_uring and publish buffers. The
+ * classes are the powers of two from 2^slab_min_shift to 2^slab_max_shift
+ * bytes, larger sizes go to malloc. Buffers are cache line aligned and may
+ * be freed by any thread.
+ *
+ * Each thread keeps free lists of its own, so most calls take no lock. A
+ * thread short of buffers refills from a shared depot per class, one with
+ * too many hands a batch back to it. That also carries the buffers from
+ * the thread that frees them (an event loop) to the one that allocates
+ * them (an acceptor).
+ */
+#define slab_line 64
+#define slab_min_shift 6
+#define slab_max_shift 18
+#define slab_classes (slab_max_shift - slab_min_shift + 1)
+
+/**
+ * Capacity of the buffer slab_alloc() returns for @param size, all of
+ * which may be used.
+ */
+size_t slab_size(size_t size);
+
+/**
+ * Allocate a buffer of at least @param size bytes, uninitialised.
+ * @return the buffer, or NULL if memory ran out.
+ */
+void *slab_alloc(size_t size);
+
+/**
+ * Return @param buf, allocated for @param size bytes or its slab_size().
+ */
+void slab_free(void *buf, size_t size);
+
+/**
+ * Format the pool stats of every class used so far as a single line JSON
+ * object: hits on the thread's own list, refills from the depot, misses
+ * that went to malloc, frees and releases back to malloc.
+ * @return the length written to @param buf, truncated at @param size.
+ */
+size_t slab_format(char *buf, size_t size);
+
+#endif
@@ -0,0 +1,92 @@
+#include "timer_wheel.h"
+#include <string.h>
+
+#define slot_mask (timer_wheel_slots - 1)
+
+void timer_wheel_init(struct timer_wheel_t *wheel, uint64_t now)
+{
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = now;
+    for (int level = 0; level < timer_wheel_levels; level++) {
+        for (int i = 0; i < timer_wheel_slots; i++) {
+            LIST_INIT(&wheel->slots[level][i]);
+        }
+    }
+}
+
+void wheel_timer_init(struct wheel_timer_t *timer, void (*expire)(struct wheel_timer_t *timer, uint64_t now),
+                      void *arg)
+{
+    memset(timer, 0, sizeof(*timer));
+    timer->expire = expire;
+    timer->arg = arg;
+}
+
+// Link an unarmed timer into the slot for its expiry: the lowest level
+// whose span reaches it, so it is looked at again at most once per level
+static void link_timer(struct timer_wheel_t *wheel, struct wheel_timer_t *timer)
+{
+    uint64_t delta = timer->expires - wheel->now;
+    int level = 0;
+
+    while (level < timer_wheel_levels - 1 && delta >> (timer_wheel_bits * (level + 1)) != 0) {
+        level++;
+    }
+    if (delta >> (timer_wheel_bits * (level + 1)) != 0) {
+        // Beyond the top level, expire at its far end and be re-checked then
+        timer->expires = wheel->now + ((uint64_t)1 << (timer_wheel_bits * timer_wheel_levels)) - 1;
+    }
+    unsigned slot = (timer->expires >> (timer_wheel_bits * level)) & slot_mask;
+    LIST_INSERT_HEAD(&wheel->slots[level][slot], timer, entries);
+    timer->armed = true;
+}
+
+void timer_wheel_add(struct timer_wheel_t *wheel, struct wheel_timer_t *timer, uint64_t expires)
+{
+    timer_wheel_del(wheel, timer);
+    timer->expires = expires > wheel->now ? expires : wheel->now + 1;
+    link_timer(wheel, timer);
+}
+
+void timer_wheel_del(struct timer_wheel_t *wheel, struct wheel_timer_t *timer)
+{
+    (void)wheel;
+    if (timer->armed) {
+        LIST_REMOVE(timer, entries);
+        timer->armed = false;
+    }
+}
+
+// Move the timers of one slot down to the levels below, now that they
+// are within their span
+static void cascade(struct timer_wheel_t *wheel, int level)
+{
+    struct timer_slot_t *slot = &wheel->slots[level][(wheel->now >> (timer_wheel_bits * level)) & slot_mask];
+    struct wheel_timer_t *timer;
+
+    while ((timer = LIST_FIRST(slot)) != NULL) {
+        LIST_REMOVE(timer, entries);
+        timer->armed = false;
+        link_timer(wheel, timer);
+    }
+}
+
+void timer_wheel_advance(struct timer_wheel_t *wheel, uint64_t now)
+{
+    while (wheel->now < now) {
+        wheel->now++;
+        // At the start of each turn of a level, refill it from the one above
+        for (int level = 1; level < timer_wheel_levels; level++) {
+            if ((wheel->now >> (timer_wheel_bits * (level - 1))) & slot_mask) break;
+            cascade(wheel, level);
+        }
+
+        struct timer_slot_t *slot = &wheel->slots[0][wheel->now & slot_mask];
+        struct wheel_timer_t *timer;
+        while ((timer = LIST_FIRST(slot)) != NULL) {
+            LIST_REMOVE(timer, entries);
+            timer->armed = false;
+            timer->expire(timer, wheel->now);
+        }
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "queue.h"
+
+#define timer_wheel_bits 6
+#define timer_wheel_slots (1 << timer_wheel_bits)
+#define timer_wheel_levels 4
+
+/**
+ * A timer on a wheel, expiring at tick @param expires. The timer is owned
+ * by the caller, the wheel only links it, so arming one never allocates.
+ */
+struct wheel_timer_t {
+    uint64_t expires;
+    void (*expire)(struct wheel_timer_t *timer, uint64_t now);
+    void *arg;
+    bool armed;
+    LIST_ENTRY(wheel_timer_t) entries;
+};
+
+LIST_HEAD(timer_slot_t, wheel_timer_t);
+
+/**
+ * Hierarchical timing wheel: level 0 holds the timers due in the next
+ * timer_wheel_slots ticks, one slot per tick, and each level above covers
+ * timer_wheel_slots times the span of the one below. Adding and removing
+ * a timer is O(1); a tick runs the timers in one slot and, once per turn
+ * of a level, moves one slot of the level above down. Timers further out
+ * than the top level covers are clamped to it. Not thread safe, the caller
+ * serialises access.
+ */
+struct timer_wheel_t {
+    uint64_t now;
+    struct timer_slot_t slots[timer_wheel_levels][timer_wheel_slots];
+};
+
+/**
+ * Start an empty wheel at tick @param now.
+ */
+void timer_wheel_init(struct timer_wheel_t *wheel, uint64_t now);
+
+/**
+ * Set up @param timer to call @param expire, with @param arg for it.
+ */
+void wheel_timer_init(struct wheel_timer_t *timer, void (*expire)(struct wheel_timer_t *timer, uint64_t now),
+                      void *arg);
+
+/**
+ * Arm @param timer for tick @param expires, or the next tick if that is
+ * not in the future. An armed timer is moved.
+ */
+void timer_wheel_add(struct timer_wheel_t *wheel, struct wheel_timer_t *timer, uint64_t expires);
+
+/**
+ * Disarm @param timer, if armed.
+ */
+void timer_wheel_del(struct timer_wheel_t *wheel, struct wheel_timer_t *timer);
+
+/**
+ * Advance the wheel to tick @param now, calling the expire function of
+ * every timer due on the way, in tick order. It may re-arm any timer.
+ */
+void timer_wheel_advance(struct timer_wheel_t *wheel, uint64_t now);
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/**
+ * Minimal io_uring wrapper on top of the raw system calls, so aesdsocket
+ * does not need liburing on the target. One ring is used by one thread.
+ */
+struct uring_t {
+    int ring_fd;
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sqe_tail;      // local tail, published by uring_submit()
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_len;
+    size_t cq_len;
+    size_t sqes_len;
+};
+
+/**
+ * Probe whether the running kernel lets this process create a ring.
+ * @return true if io_uring can be used, false to fall back to plain syscalls.
+ */
+bool uring_supported(void);
+
+/**
+ * Create a ring with at least @param entries submission queue entries.
+ * @return 0 on success or a negative errno value.
+ */
+int uring_init(struct uring_t *ring, unsigned entries);
+
+/**
+ * Unmap and close a ring created by uring_init.
+ */
+void uring_exit(struct uring_t *ring);
+
+/**
+ * Register @param nr file descriptors, referenced afterwards by index with IOSQE_FIXED_FILE.
+ * @return 0 on success or a negative errno value.
+ */
+int uring_register_files(struct uring_t *ring, const int *fds, unsigned nr);
+
+/**
+ * Register @param nr buffers for IORING_OP_READ_FIXED/WRITE_FIXED, referenced by index.
+ * @return 0 on success or a negative errno value.
+ */
+int uring_register_buffers(struct uring_t *ring, const struct iovec *iovs, unsigned nr);
+
+/**
+ * Get a zeroed submission queue entry, or NULL when the queue is full.
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring_t *ring);
+
+/**
+ * Submit all queued entries and wait for @param wait_nr completions in one system call.
+ * @return number of entries submitted or a negative errno value.
+ */
+int uring_submit_and_wait(struct uring_t *ring, unsigned wait_nr);
+
+/**
+ * Fetch the next completion without blocking.
+ * @return the completion, or NULL when the completion queue is empty.
+ */
+struct io_uring_cqe *uring_peek_cqe(struct uring_t *ring);
+
+/**
+ * Fetch the next completion, blocking in the kernel until one is posted.
+ * @return the completion, or NULL if waiting failed.
+ */
+struct io_uring_cqe *uring_wait_cqe(struct uring_t *ring);
+
+/**
+ * Release the completion returned by uring_peek_cqe or uring_wait_cqe.
+ */
+void uring_cqe_seen(struct uring_t *ring);
+
+#endif